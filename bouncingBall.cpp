@@ -1,24 +1,256 @@
-//g++ bouncingBall.cpp -lSDL2 -lSDL2_image -lSDL2_ttf -o BouncingBall
+//g++ -std=c++20 -pthread bouncingBall.cpp -lSDL2 -lSDL2_ttf -lrt -o BouncingBall, the Makefile adds the vectoriser flags
 
 #include <SDL2/SDL.h>
-#include <SDL2/SDL_image.h>
 #include <SDL2/SDL_ttf.h>
 #include <stdio.h>
+#include <math.h>
 #include <string>
 #include <vector>
 #include <sstream>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <coroutine>
+#include <algorithm>
+#include <functional>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <pthread.h>
+#include "sharedState.h"
+#include "world.h"
 
 #define PI 3.14159265
 
 using namespace std;
+
+//The engine lives in its own namespace, so a program linking the library keeps its own init, close or distance
+namespace bouncingball{
+
 //Screen dimension constants
 const int SCREEN_WIDTH = 500;
 const int SCREEN_HEIGHT = 500;
 
 //A circle stucture
 struct Circle{
-	int x, y;
-	int r;
+	double x, y;
+	double r;
+};
+
+//Plain copy of a ball used to ship it between processes
+struct BallState{
+	double posX, posY;
+	double velX, velY;
+	double r;
+	int pocketed;
+};
+
+//Straight piece of table boundary
+struct Segment{
+	double x1, y1;
+	double x2, y2;
+
+	//Cushions only face the table, on the left of the direction from 1 to 2, jaws face both ways
+	bool oneSided;
+};
+
+//Axis aligned box
+struct Bounds{
+	double minX, minY;
+	double maxX, maxY;
+};
+
+//Hole that captures any ball whose center enters it
+struct Pocket{
+	double x, y;
+	double r;
+};
+
+//Stable reference to a ball that stays valid while other balls come and go
+struct BallHandle{
+	Uint32 slot;
+	Uint32 generation;
+};
+
+//Maps handles to positions in gBalls, which are packed by swap-and-pop removal
+class BallRegistry{
+	public:
+		//Forgets every handle
+		void clear();
+
+		//Hands out a handle for the ball just appended at index
+		BallHandle add(int index);
+
+		//Releases the handle of the ball at index after the ball at last was moved into its place
+		void removeAt(int index, int last);
+
+		//Position of the ball in gBalls, -1 if the handle is stale
+		int indexOf(BallHandle handle);
+
+		//Handle of the ball at a position in gBalls
+		BallHandle handleAt(int index);
+
+		//The ball at order[i] moved to i
+		void permute(const std::vector<int>& order);
+
+	private:
+		//Slot per handle, index is -1 while the slot is free
+		struct Slot{
+			Uint32 generation;
+			int index;
+		};
+
+		std::vector<Slot> mSlots;
+		std::vector<Uint32> mFreeSlots;
+
+		//Slot of each ball in gBalls
+		std::vector<Uint32> mSlotOfIndex;
+};
+
+//Uniform grid broadphase, each ball is kept in the cell holding its center
+class SpatialGrid{
+	public:
+		//Initializes variables
+		SpatialGrid();
+
+		//Empties the grid and sizes its cells for a table and the largest ball radius. A wrapping grid tiles the
+		//table exactly, so the cells past one edge are the first cells of the opposite one
+		void reset(double width, double height, double maxRadius, bool wrap);
+
+		//Adds, removes and relinks the ball at an index in gBalls
+		void insert(int index, double x, double y);
+		void remove(int index);
+		void update(int index, double x, double y);
+
+		//The ball at oldIndex now lives at newIndex after a swap-and-pop
+		void rename(int oldIndex, int newIndex);
+
+		//The ball at order[i] moved to i, cells keep their balls
+		void permute(const std::vector<int>& order);
+
+		//Row-major index of the cell holding a point
+		int cellFor(double x, double y);
+
+		//Calls visit(index) for every ball in the cells around a point
+		template <typename Visit>
+		void query(double x, double y, Visit visit){
+			int column = columnFor(x), row = rowFor(y);
+			if(mWrap){
+				queryWrapped(column, row, visit);
+				return;
+			}
+			for(int r = row - 1; r <= row + 1; r++){
+				if(r < 0 || r >= mRows){
+					continue;
+				}
+				for(int c = column - 1; c <= column + 1; c++){
+					if(c < 0 || c >= mColumns){
+						continue;
+					}
+					const std::vector<int>& cell = mCells[r*mColumns + c];
+					for(int i = 0; i < cell.size(); i++){
+						visit(cell[i]);
+					}
+				}
+			}
+		}
+
+	private:
+		//Cell coordinates, clamped so balls off the table land in an edge cell
+		int columnFor(double x);
+		int rowFor(double y);
+
+		//Neighbour cells taken modulo the grid, each visited once even when the grid is under three cells across
+		template <typename Visit>
+		void queryWrapped(int column, int row, Visit visit){
+			int spanX = std::min(mColumns, 3), spanY = std::min(mRows, 3);
+			for(int j = 0; j < spanY; j++){
+				int r = (row + j - (spanY == 3) + mRows) % mRows;
+				for(int i = 0; i < spanX; i++){
+					int c = (column + i - (spanX == 3) + mColumns) % mColumns;
+					const std::vector<int>& cell = mCells[r*mColumns + c];
+					for(int k = 0; k < cell.size(); k++){
+						visit(cell[k]);
+					}
+				}
+			}
+		}
+
+		//Cell sides, equal unless the grid wraps and has to tile the table exactly
+		double mCellWidth, mCellHeight;
+		int mColumns, mRows;
+		bool mWrap;
+		std::vector< std::vector<int> > mCells;
+
+		//Cell of each ball and its position inside that cell
+		std::vector<int> mCellOf;
+		std::vector<int> mSlotInCell;
+};
+
+//Static table boundary, cushions kept in a bounding volume hierarchy plus pockets
+class TableGeometry{
+	public:
+		//Initializes variables
+		TableGeometry();
+
+		//Four plain walls around the table
+		void buildBox(double width, double height);
+
+		//Cushions broken by six pockets, with rounded jaws leading into them
+		void buildBilliard(double width, double height, double pocketRadius);
+
+		//No cushions, a ball leaving one edge comes back at the opposite one
+		void buildPeriodic(double width, double height);
+
+		bool isPeriodic();
+
+		//Brings a point on a periodic table back inside it, true if it moved
+		bool wrap(double& x, double& y);
+
+		//Shortens a separation to the nearest image of the other point on a periodic table
+		void minimumImage(double& dx, double& dy);
+
+		//Bounces a ball off every cushion it overlaps, returns how many it hit
+		int collide(double& x, double& y, double& velX, double& velY, double r);
+
+		//Checks if a ball centered here has dropped into a pocket
+		bool inPocket(double x, double y);
+
+		//Draws the cushions and pockets
+		void render();
+
+		bool hasPockets();
+
+	private:
+		//Hierarchy node, leaves own a run of mSegments
+		struct Node{
+			Bounds box;
+			int left, right;
+			int first, count;
+		};
+
+		//Adds a polyline approximating an arc between two angles
+		void addArc(double x, double y, double r, double startAngle, double endAngle, int pieces);
+
+		//Builds the hierarchy over mSegments[first, first + count)
+		int buildNode(int first, int count);
+
+		double mWidth, mHeight;
+		bool mPeriodic;
+		std::vector<Segment> mSegments;
+		std::vector<Node> mNodes;
+		std::vector<Pocket> mPockets;
 };
 
 //Texture wrapper class
@@ -30,8 +262,8 @@ class LTexture{
 		//Deallocates memory
 		~LTexture();
 
-		//Loads image at specified path
-		bool loadFromFile( std::string path );
+		//Creates a blended texture from ARGB8888 pixels with straight alpha
+		bool loadFromPixels(const Uint32* pixels, int width, int height);
 
 		#ifdef _SDL_TTF_H
 		//Creates image from font string
@@ -57,6 +289,9 @@ class LTexture{
 		int getWidth();
 		int getHeight();
 
+		//Texture for renderer calls the wrapper does not cover
+		SDL_Texture* getTexture();
+
 	private:
 		//The actual hardware texture
 		SDL_Texture* mTexture;
@@ -66,6 +301,67 @@ class LTexture{
 		int mHeight;
 };
 
+//Ball sprite drawn at startup instead of loaded from disk, an anti-aliased disc in a chain of sizes that each
+//halve the one before, so a ball of any size is drawn from a level close to it
+class BallSprite{
+	public:
+		//Enough halvings for a disc thousands of pixels across
+		static const int MAX_LEVELS = 16;
+
+		//Initializes variables
+		BallSprite();
+
+		//Draws every level from diameter pixels down to one, and uploads them as textures when a renderer exists
+		bool create(int diameter);
+
+		//Frees the textures
+		void free();
+
+		//Smallest level at least this many pixels across, the largest level if none is
+		int levelFor(double diameter);
+
+		int getLevels();
+		int getSize(int level);
+		const Uint32* getPixels(int level);
+		LTexture& getTexture(int level);
+
+		//Tints every level
+		void setColor(Uint8 red, Uint8 green, Uint8 blue);
+
+	private:
+		//A black disc filling a size by size square, each pixel's alpha its coverage from 4x4 samples
+		static void drawDisc(int size, std::vector<Uint32>& pixels);
+
+		int mLevels;
+		int mSizes[MAX_LEVELS];
+		std::vector<Uint32> mPixels[MAX_LEVELS];
+		LTexture mTextures[MAX_LEVELS];
+};
+
+//Opens a font on a background thread, so the first frame does not wait for SDL_ttf and the disk
+class AsyncFont{
+	public:
+		//Initializes variables
+		AsyncFont();
+
+		//Joins the loader
+		~AsyncFont();
+
+		//Starts SDL_ttf and opens the font in the background
+		void load(std::string path, int size);
+
+		//The font once it is open, NULL while it is loading or if it failed
+		TTF_Font* get();
+
+		//Waits for the loader and closes the font
+		void close();
+
+	private:
+		std::thread mThread;
+		std::atomic<bool> mReady;
+		TTF_Font* mFont;
+};
+
 //The ball that will move around on the screen
 class Ball{
     public:
@@ -73,17 +369,25 @@ class Ball{
 		static const int BALL_WIDTH = 20;
 		static const int BALL_HEIGHT = 20;
 
-		//Maximum axis velocity of the ball
-		static const int BALL_VEL = 1;
+		//Cap on how finely a single fast move is split
+		static const int MAX_SUBSTEPS = 64;
+
+		//Mass of every ball
+		static const int BALL_MASS = 1;
 
-		//Initializes the variables
-		Ball(int x, int y, int velX, int velY);
+		//Initializes the variables, position in pixels and velocity in pixels per second
+		Ball(double x, double y, double velX, double velY);
 
-        int getVelX();
-        int getVelY();
+        double getVelX();
+        double getVelY();
 
-		//Moves the ball and checks collision
-		void move(int currentBall);
+		//Moves the ball through a substep of h seconds and bounces it off the cushions
+		void move(int currentBall, double h);
+
+		//Moves count balls through a substep on a box or periodic table in one branch-free pass, keeping their
+		//colliders in step. Adds the momentum given to the walls to impulse and the pressure impulse to pressure,
+		//and returns the wall bounces. Cushions with pockets need move
+		static int integrate(Ball* balls, Circle* colliders, int count, double h, bool periodic, double impulse[2], double& pressure);
 
 		//Shows the ball on the screen
 		void render();
@@ -92,19 +396,35 @@ class Ball{
 		//Gets collision circle
 		Circle& getCollider();
 
-		//The velocity of the ball
+		//Copies the ball's position and velocity out of and back into the ball
+		BallState getState();
+		void setState(const BallState& state);
+
+		//Checks if the ball has dropped into a pocket and left play
+		bool isPocketed();
 
+		//Moves the ball, trading speed for height so a push up or down the table keeps its energy
+		void setPosition(double x, double y);
+
+		//Position of the ball's center and its velocity, declared first so they share the ball's first 32 bytes
+		double mPosX, mPosY;
 		double mVelX, mVelY;
 
     private:
-		//The X and Y offsets of the ball
-		int mPosX, mPosY;
-
 		//Ball's collision circle
 		Circle mCollider;
 
+		//Set once the ball drops into a pocket
+		bool mPocketed;
+
 		//Moves the collision circle relative to the ball's offset
 		void shiftColliders();
+
+		//Bounces the ball off the cushions at its current position and checks the pockets
+		void collide(int currentBall);
+
+		//Takes the ball out of play
+		void pocket();
 };
 
 //The application time based timer
@@ -132,481 +452,6740 @@ class LTimer{
 		bool mStarted;
 };
 
-//Starts up SDL and creates window
-bool init();
+//Bounded single-producer/single-consumer lock-free ring queue
+template <typename T>
+class RingQueue{
+	public:
+		//Allocates room for at least capacity elements
+		RingQueue(size_t capacity = 1){
+			reset(capacity);
+		}
 
-//Loads media
-bool loadMedia();
+		//Empties the queue and resizes it, only while neither side is running
+		void reset(size_t capacity){
+			size_t size = 1;
+			while(size < capacity){
+				size <<= 1;
+			}
+			mSlots.resize(size);
+			mMask = size - 1;
+			mHead.store(0);
+			mTail.store(0);
+		}
 
-//Frees media and shuts down SDL
-void close();
+		//Producer side, fails when the queue is full
+		bool push(const T& item){
+			size_t tail = mTail.load(std::memory_order_relaxed);
+			if(tail - mHead.load(std::memory_order_acquire) > mMask){
+				return false;
+			}
+			mSlots[tail & mMask] = item;
+			mTail.store(tail + 1, std::memory_order_release);
+			return true;
+		}
 
-//Load balls in a vector
-void loadBalls(int n);
+		//Consumer side, fails when the queue is empty
+		bool pop(T& item){
+			size_t head = mHead.load(std::memory_order_relaxed);
+			if(head == mTail.load(std::memory_order_acquire)){
+				return false;
+			}
+			item = mSlots[head & mMask];
+			mHead.store(head + 1, std::memory_order_release);
+			return true;
+		}
 
-//Circle/Circle collision detector
-bool checkCollision(Circle& a, Circle& b);
+		bool empty(){
+			return mHead.load(std::memory_order_acquire) == mTail.load(std::memory_order_acquire);
+		}
 
-//Calculates distance squared between two points
-double distance(int x1, int y1, int x2, int y2);
+	private:
+		std::vector<T> mSlots;
+		size_t mMask;
 
-//responsible for transfer of velocities from each other
-void calculateNewVel(Ball& curBall, Ball& otherBall);
+		//Read and write positions, only ever increasing
+		std::atomic<size_t> mHead;
+		std::atomic<size_t> mTail;
+};
 
-//pushes the balls away if animated on top of each otehr
-void nudgeBallLoop();
+//Grabs rendered frames into pooled buffers and encodes them on a writer thread
+class FrameCapture{
+	public:
+		//What to do when every buffer is waiting on the writer
+		enum Policy { DROP_FRAMES, BACKPRESSURE };
 
-void nudgeBallMath(Circle& curBall, Circle& otherBall);
-//The window we'll be rendering to
-SDL_Window* gWindow = NULL;
+		//Output stream layout
+		enum Format { FORMAT_Y4M, FORMAT_RAW };
 
-//The window renderer
-SDL_Renderer* gRenderer = NULL;
+		//Initializes variables
+		FrameCapture();
 
-//Global Timer
-LTimer gTimer;
+		//Stops the writer if still running
+		~FrameCapture();
 
-//Scene textures
-LTexture gBallTexture;
+		//Opens the output file, allocates the buffer pool and starts the writer thread
+		bool start(std::string path, int width, int height, int fps, Format format, Policy policy, int bufferCount);
 
-//Globally used font
-TTF_Font* gFont = NULL;
+		//Reads the current render target into a free buffer and queues it for the writer
+		void captureFrame();
 
-//Scene textures
-LTexture gFPSTextTexture;
+		//Drains queued frames, joins the writer and reports what happened
+		void stop();
 
-//Vector for the balls
-vector<Ball> gBalls;
-vector<Circle> gColliders;
+		bool isRunning();
 
-int main( int argc, char* args[] ){
-	//Start up SDL and create window
-	if(!init()){
-		printf( "Failed to initialize!\n" );
-	}
-	else{
-		//Load media
-		if(!loadMedia()){
-			printf( "Failed to load media!\n" );
-		}
-		else{
-			//Main loop flag
-			bool quit = false;
+	private:
+		//Writer thread body
+		void writerLoop();
 
-			//Event handler
-			SDL_Event e;
+		//Converts one BGRA frame to 4:2:0 and writes it
+		void writeY4MFrame(const std::vector<Uint8>& pixels);
 
-			//Set text color as black
-			SDL_Color textColor = {0, 0, 0, 255};
+		FILE* mFile;
+		std::string mPath;
+		int mWidth, mHeight;
+		Format mFormat;
+		Policy mPolicy;
 
-			//In memory text stream
-			stringstream timeText;
+		//Reusable frame buffers and the indices moving between the two threads
+		std::vector< std::vector<Uint8> > mBuffers;
+		RingQueue<int> mFreeBuffers;
+		RingQueue<int> mFilledBuffers;
 
-			//Start global timer
-			gTimer.start();
+		//Buffer the main loop took but could not fill, kept for the next frame since only the writer pushes free
+		//buffers. -1 when there is none
+		int mHeldBuffer;
 
-			//The frames per second timer
-			LTimer fpsTimer;
+		//Scratch planes used by the writer
+		std::vector<Uint8> mPlanes;
 
-			//Start counting frames per second
-			int countedFrames = 0;
-			fpsTimer.start();
+		std::thread mWriter;
+		std::atomic<bool> mRunning;
 
-			//Count of balls in screen
-			int nBalls = 50;
+		//Counters for the final report
+		int mCaptured, mDropped;
+		std::atomic<int> mWritten;
+		double mStallMs;
+};
 
-			//loadBalls in vector gBalls
-			loadBalls(nBalls);
+//One ball as the renderer, recorder and viewers see it
+struct RenderBall{
+	//Center quantised to 1/65535 of the world bounds
+	Uint16 x, y;
 
-			nudgeBallLoop();
+	//Radius in 1/16 pixel steps
+	Uint16 radius;
 
-			//While application is running
-			while(!quit){
-				//Handle events on queue
-				while(SDL_PollEvent(&e) != 0){
-					//User requests quit
-					if(e.type == SDL_QUIT){
-						quit = true;
-					}
-				}
+	//Entry in RenderSnapshot::PALETTE the sprite is tinted with
+	Uint16 color;
+};
+static_assert(sizeof(RenderBall) == 8, "RenderBall is written to disk as 8 bytes");
 
-				//Clear screen
-				SDL_SetRenderDrawColor(gRenderer, 0xFF, 0xFF, 0xFF, 0xFF);
-				SDL_RenderClear(gRenderer);
+//Compact per-step copy of the balls in play, the only thing drawing reads
+class RenderSnapshot{
+	public:
+		//Sprite tints, 0 leaves the ball texture as it is
+		static const int PALETTE_SIZE = 8;
+		static const SDL_Color PALETTE[PALETTE_SIZE];
 
-				//Calculate and correct fps
-				float avgFPS = countedFrames/(fpsTimer.getTicks()/1000.f);
-				if(avgFPS > 2000000){
-					avgFPS = 0;
-				}
+		//Initializes variables
+		RenderSnapshot();
 
-				//Set text to be rendered
-				timeText.str("");
-				timeText << "Average Frames Per Second " << avgFPS;
+		//Quantises every unpocketed ball against the world bounds, wrapped when the world is periodic
+		void pack(std::vector<Ball>& balls, BallRegistry& registry, double worldWidth, double worldHeight, bool colored, bool wrapped);
 
-				//Render text
-				if(!gFPSTextTexture.loadFromRenderedText(timeText.str().c_str(), textColor)){
-					printf("Unable to render FPS texture!\n");
-				}
-				gFPSTextTexture.render((SCREEN_WIDTH-gFPSTextTexture.getWidth())/2, 0);
-                nudgeBallLoop();
-				//Move and render the balls inside the vector gBalls
-				for(int i = 0; i < nBalls; i++){
-					//bug: Needs to include all the balls inside the gBalls for the move method
-					gBalls.at(i).move(i);
-					gBalls.at(i).render();
-				}
+		//Screen position and radius of a packed ball
+		double toX(const RenderBall& ball) const;
+		double toY(const RenderBall& ball) const;
+		double toRadius(const RenderBall& ball) const;
 
-				//Update screen
-				SDL_RenderPresent(gRenderer);
-				++countedFrames;
+		int size() const;
+		const RenderBall& operator[](int index) const;
+		const RenderBall* data() const;
 
-			}
-		}
-	}
-	//Free resources and close SDL
-	close();
-	return 0;
-}
+		double getWorldWidth() const;
+		double getWorldHeight() const;
 
-LTexture::LTexture(){
-	//Initialize
-	mTexture = NULL;
-	mWidth = 0;
-	mHeight = 0;
-}
+		//Balls over an edge of a wrapped world also show at the opposite edge
+		bool isWrapped() const;
 
-LTexture::~LTexture(){
-	//Deallocate
-	free();
-}
+	private:
+		double mWorldWidth, mWorldHeight;
+		bool mWrapped;
+		std::vector<RenderBall> mBalls;
 
-bool LTexture::loadFromFile(std::string path){
-	//Get rid of preexisting texture
-	free();
+		//Gathered positions for the vectorised quantise loop
+		std::vector<float> mX, mY, mR;
+};
 
-	//The final texture
-	SDL_Texture* newTexture = NULL;
+//Appends snapshots to a file that viewers can replay
+class SnapshotRecorder{
+	public:
+		//Initializes variables
+		SnapshotRecorder();
 
-	//Load image at specified path
-	SDL_Surface* loadedSurface = IMG_Load( path.c_str() );
-	if( loadedSurface == NULL ){
-		printf( "Unable to load image %s! SDL_image Error: %s\n", path.c_str(), IMG_GetError() );
-	}
-	else{
-		//Color key image
-		SDL_SetColorKey( loadedSurface, SDL_TRUE, SDL_MapRGB( loadedSurface->format, 0, 0xFF, 0xFF ) );
+		//Closes the file if still open
+		~SnapshotRecorder();
 
-		//Create texture from surface pixels
-        newTexture = SDL_CreateTextureFromSurface( gRenderer, loadedSurface );
-		if( newTexture == NULL ){
-			printf( "Unable to create texture from %s! SDL Error: %s\n", path.c_str(), SDL_GetError() );
-		}
-		else{
-			//Get image dimensions
-			mWidth = loadedSurface->w;
-			mHeight = loadedSurface->h;
-		}
+		//Creates the file and writes its header
+		bool start(std::string path, double worldWidth, double worldHeight);
 
-		//Get rid of old loaded surface
-		SDL_FreeSurface( loadedSurface );
-	}
+		//Writes one step's snapshot
+		void write(Uint64 step, const RenderSnapshot& snapshot);
 
-	//Return success
-	mTexture = newTexture;
-	return mTexture != NULL;
-}
+		//Closes the file and reports what was written
+		void stop();
 
-#ifdef _SDL_TTF_H
-bool LTexture::loadFromRenderedText(std::string textureText, SDL_Color textColor){
-	//Get rid of preexisting texture
-	free();
+		bool isRunning();
 
-	//Render text surface
-	SDL_Surface* textSurface = TTF_RenderText_Solid( gFont, textureText.c_str(), textColor );
-	if(textSurface != NULL){
-		//Create texture from surface pixels
-        mTexture = SDL_CreateTextureFromSurface( gRenderer, textSurface );
-		if(mTexture == NULL){
-			printf( "Unable to create texture from rendered text! SDL Error: %s\n", SDL_GetError() );
-		}
-		else{
-			//Get image dimensions
-			mWidth = textSurface->w;
-			mHeight = textSurface->h;
-		}
+	private:
+		FILE* mFile;
+		std::string mPath;
+		int mRecorded;
+		Uint64 mBytes;
+};
 
-		//Get rid of old surface
-		SDL_FreeSurface( textSurface );
-	}
-	else{
-		printf( "Unable to render text surface! SDL_ttf Error: %s\n", TTF_GetError() );
-	}
+//Publishes every completed step into a POSIX shared memory segment laid out as in sharedState.h.
+//Two buffers are written in turn, each behind a seqlock, so readers in other processes can read the
+//latest step in place while the next one is written and the writer never waits for them
+class SharedStateExport{
+	public:
+		//Initializes variables
+		SharedStateExport();
 
+		//Removes the segment if still published
+		~SharedStateExport();
 
-	//Return success
-	return mTexture != NULL;
-}
-#endif
+		//Creates the segment under name, sized for capacity balls
+		bool start(std::string name, int capacity, double worldWidth, double worldHeight);
 
-void LTexture::free(){
-	//Free texture if it exists
-	if(mTexture != NULL){
-		SDL_DestroyTexture( mTexture );
-		mTexture = NULL;
-		mWidth = 0;
-		mHeight = 0;
-	}
-}
+		//Copies gBalls into the buffer readers are not on, moving to a bigger segment when they do not fit
+		void publish(Uint64 step, double time);
 
-void LTexture::setColor(Uint8 red, Uint8 green, Uint8 blue){
-	//Modulate texture rgb
-	SDL_SetTextureColorMod(mTexture, red, green, blue);
-}
+		//Retires the segment and removes its name, readers that have it mapped keep the last step
+		void stop();
 
-void LTexture::setBlendMode(SDL_BlendMode blending){
-	//Set blending function
-	SDL_SetTextureBlendMode( mTexture, blending );
-}
+		bool isRunning();
 
-void LTexture::setAlpha(Uint8 alpha){
-	//Modulate texture alpha
-	SDL_SetTextureAlphaMod( mTexture, alpha );
+	private:
+		//Maps a fresh segment, retiring the current one
+		bool create(int capacity);
+
+		std::string mName;
+		double mWorldWidth, mWorldHeight;
+		SharedStateHeader* mHeader;
+		size_t mSize;
+		Uint64 mPublished;
+};
+
+//Point-to-point channel between domain workers and the coordinator
+class DomainTransport{
+	public:
+		//Peer id of the process that renders the merged result
+		static const int COORDINATOR = -1;
+
+		//What a message carries
+		enum Tag { TAG_STEP, TAG_QUIT, TAG_GHOSTS, TAG_MIGRANTS, TAG_RESULTS };
+
+		virtual ~DomainTransport(){}
+
+		//Sends a tagged block of balls to a peer
+		virtual bool send(int peer, int tag, const std::vector<BallState>& balls) = 0;
+
+		//Blocks until the next message from a peer arrives
+		virtual bool receive(int peer, int& tag, std::vector<BallState>& balls) = 0;
+};
+
+//Local transport over Unix domain socket pairs
+class SocketTransport : public DomainTransport{
+	public:
+		//Creates a transport with no connected peers, for domains workers
+		SocketTransport(int domains);
+
+		//Closes every connected socket
+		~SocketTransport();
+
+		//Attaches a socket to a peer
+		void connect(int peer, int fd);
+
+		//Closes every socket that does not belong to the given rank
+		void keepOnly(int rank);
+
+		bool send(int peer, int tag, const std::vector<BallState>& balls);
+		bool receive(int peer, int& tag, std::vector<BallState>& balls);
+
+	private:
+		//Socket per peer, indexed by peer + 1 so the coordinator is slot 0
+		std::vector<int> mPeerFds;
+
+		//Reads or writes exactly size bytes
+		bool writeAll(int fd, const void* data, size_t size);
+		bool readAll(int fd, void* data, size_t size);
+};
+
+//Splits the table into vertical strips, each stepped by its own worker process
+class DomainSimulation{
+	public:
+		//Initializes variables
+		DomainSimulation();
+
+		//Stops the workers if still running
+		~DomainSimulation();
+
+		//Hands the balls in gBalls to forked workers, one per strip
+		bool start(int domains);
+
+		//Advances every domain one step and merges the owned balls back into gBalls
+		bool step();
+
+		//Tells the workers to quit and reaps them
+		void stop();
+
+		bool isRunning();
+
+	private:
+		//Worker process body
+		static void runWorker(int rank, int domains, DomainTransport& transport, std::vector<BallState>& owned);
+
+		//Swaps a block of balls with a neighbouring domain without deadlocking
+		static bool exchange(DomainTransport& transport, int rank, int peer, int tag, const std::vector<BallState>& out, std::vector<BallState>& in);
+
+		SocketTransport* mTransport;
+		std::vector<pid_t> mWorkers;
+};
+
+//Work done by the physics in one step
+struct StepCounters{
+	int substeps;
+	int broadphasePairs;
+	int narrowTests;
+	int contacts;
+	int nudges;
+	int wallBounces;
+	int islands;
+
+	//Adds another step's counters, a frame in fast-forward covers several steps
+	void add(const StepCounters& other);
+};
+
+//Counters and phase timings of one simulation step
+struct StepStats{
+	//Step number and start time in microseconds since telemetry started
+	Uint64 step;
+	double startUs;
+
+	//Start offset and duration of each phase in microseconds
+	double phaseStartUs[8];
+	double phaseUs[8];
+
+	StepCounters counters;
+};
+
+//Records the most recent steps in a fixed size ring and exports them
+class Telemetry{
+	public:
+		//Timed parts of a step
+		enum Phase { PHASE_INPUT, PHASE_NUDGE, PHASE_MOVE, PHASE_DRAW_LIST, PHASE_OVERLAY, PHASE_RENDER, PHASE_CAPTURE, PHASE_PRESENT, PHASE_COUNT };
+
+		//Initializes variables
+		Telemetry();
+
+		//Allocates the ring and starts recording
+		void start(int capacity, double budgetUs);
+
+		bool isEnabled();
+
+		//Starts the stats of a new step
+		void beginStep(StepStats& stats, Uint64 step);
+
+		//Stores a finished step in the ring
+		void record(const StepStats& stats);
+
+		//Marks the start and end of a phase in a step
+		void beginPhase(StepStats& stats, Phase phase);
+		void endPhase(StepStats& stats, Phase phase);
+
+		//Writes the recorded steps, oldest first
+		bool exportCSV(std::string path);
+		bool exportJSON(std::string path);
+		bool exportChromeTrace(std::string path);
+
+		//Live counters of the step being taken, bumped directly by the physics code. stepSimulation starts them from
+		//zero, so the headless loops that step without frames never let them grow past one step
+		StepCounters current;
+
+	private:
+		//Microseconds since start
+		double now();
+
+		//Visits the recorded steps oldest first
+		const StepStats& recorded(size_t i);
+		size_t recordedCount();
+
+		bool mEnabled;
+		std::chrono::steady_clock::time_point mStart;
+
+		//Frames slower than this are flagged in the trace
+		double mBudgetUs;
+
+		std::vector<StepStats> mRing;
+		Uint64 mSteps;
+};
+
+//Ideal gas observables streamed out of the step loop: the speed distribution against Maxwell-Boltzmann,
+//pressure on the cushions, collision frequency and mean free path
+class GasObservables{
+	public:
+		//Speed histogram bins, covering four times the RMS speed with the last bin open ended
+		static const int SPEED_BINS = 32;
+
+		//Initializes variables
+		GasObservables();
+
+		//Closes the files if still open
+		~GasObservables();
+
+		//Opens prefix.csv and prefix.hist.csv and writes a row every steps
+		bool start(std::string prefix, int every);
+
+		bool isEnabled();
+
+		//Impulse a cushion gave a ball along its normal
+		void addWallImpulse(double impulse);
+
+		//Ball-ball collisions that exchanged momentum
+		void addCollisions(int count);
+
+		//Counts the step's time and writes a row when one is due
+		void endStep(Uint64 step);
+
+		//Closes the files and reports what was written
+		void stop();
+
+	private:
+		//Reduces over gBalls and writes the window's figures
+		void emit(Uint64 step);
+
+		bool mEnabled;
+		int mEvery;
+		std::string mPrefix;
+		FILE* mFile;
+		FILE* mHistogramFile;
+		int mRows;
+
+		//Totals since the last row
+		double mWallImpulse;
+		Uint64 mCollisions;
+		double mElapsed;
+		int mSteps;
+
+		std::vector<double> mSpeeds;
+};
+
+//Checks that energy and momentum stay put and that balls do not sink into each other
+class ConservationMonitor{
+	public:
+		//Initializes variables
+		ConservationMonitor();
+
+		//Enables the monitor, drift is relative to the first checked step
+		void start(double tolerance, double overlapLimit, bool trackMomentum);
+
+		bool isEnabled();
+
+		//Momentum handed to the walls, so it is not mistaken for drift
+		void addWallImpulse(double x, double y);
+
+		//Momentum gravity gave a ball during one substep
+		void addGravityImpulse(double y);
+
+		//Energy and momentum carried off by a pocketed ball
+		void addRemoved(double energy, double momentumX, double momentumY);
+
+		//Depth of a contact found by the narrow phase this step
+		void addOverlap(double depth);
+
+		//Physics time of the step just taken, for the overhead figure
+		void addStepTime(double us);
+
+		//Reduces over gBalls and flags drift past the tolerance
+		void check(Uint64 step);
+
+		//Takes a new reference at the next check, after balls were added or pushed from outside the physics
+		void resetReference();
+
+		//Prints the worst drift seen and the monitor's own cost
+		void report();
+
+	private:
+		bool mEnabled;
+		double mTolerance;
+		double mOverlapLimit;
+		bool mTrackMomentum;
+
+		//Reference values from the first step
+		bool mHaveReference;
+		double mEnergy0;
+		double mMomentumX0, mMomentumY0;
+
+		//Momentum taken by the walls since the reference
+		double mWallImpulseX, mWallImpulseY;
+
+		//Momentum given by gravity since the reference
+		double mGravityImpulseY;
+
+		//Energy and momentum that left with pocketed balls
+		double mRemovedEnergy, mRemovedMomentumX, mRemovedMomentumY;
+
+		//Deepest contact this step
+		double mOverlap;
+
+		//Worst values seen and how many steps were flagged
+		double mMaxEnergyDrift, mMaxMomentumDrift, mMaxOverlap;
+		int mFlaggedSteps;
+		bool mFlagging;
+
+		//Time spent in check() against time spent stepping
+		double mMonitorUs, mStepUs;
+		Uint64 mChecks;
+};
+
+//Hardware counters of the calling thread and the threads it starts later, read through perf_event_open
+class PerfCounters{
+	public:
+		//Counted events
+		enum Counter { CYCLES, INSTRUCTIONS, CACHE_MISSES, BRANCH_MISSES, COUNTER_TOTAL };
+
+		//Initializes variables
+		PerfCounters();
+
+		//Closes the counters
+		~PerfCounters();
+
+		//Opens every counter the kernel allows, false with errno set if none could be opened
+		bool open();
+		void close();
+
+		//Zeroes and enables the counters, then disables them again
+		void start();
+		void stop();
+
+		//Events since start, -1 for a counter that could not be opened
+		long long read(Counter counter);
+
+	private:
+		int mFds[COUNTER_TOTAL];
+};
+
+//NUMA nodes and their CPUs as listed in sysfs, used by --numa local to pin helpers and place the ball arrays
+class NumaTopology{
+	public:
+		//Most nodes the thread pool keeps separate work for
+		static const int MAX_NODES = 16;
+
+		//Initializes variables
+		NumaTopology();
+
+		//Reads /sys/devices/system/node, a machine without it is one node holding every CPU
+		void discover();
+
+		int getNodeCount();
+
+		//Node of the CPU the calling thread runs on
+		int currentNode();
+
+		//Restricts a thread to the CPUs of a node
+		bool pinThread(pthread_t thread, int node);
+
+		//Binds data to the nodes in equal consecutive shares, the same split the thread pool hands out work in.
+		//Pages already touched elsewhere are moved. An array already placed at the same address and size is skipped
+		void place(const void* data, size_t bytes);
+
+	private:
+		//Parses a sysfs list like "0-3,8-11"
+		static std::vector<int> parseList(const std::string& text);
+
+		//Kernel node numbers and the CPUs of each node
+		std::vector<int> mNodeIds;
+		std::vector< std::vector<int> > mCpus;
+		std::vector<int> mNodeOfCpu;
+
+		//Recently placed arrays, enough for the ball arrays and the reorder scratch they swap with
+		std::deque< std::pair<const void*, size_t> > mPlaced;
+		bool mBindFailed;
+};
+
+//Fixed set of threads that split loops with the calling thread
+class ThreadPool{
+	public:
+		//Initializes variables
+		ThreadPool();
+
+		//Joins the threads if still running
+		~ThreadPool();
+
+		//Starts and joins the helper threads, zero threads runs everything on the caller. With a topology the helpers
+		//are pinned to the nodes in turn, and each loop is split into one consecutive share per node that the
+		//node's threads work through before helping the others
+		void start(int threads, NumaTopology* topology);
+		void stop();
+
+		//Threads a parallelFor is split across, including the caller
+		int getConcurrency();
+
+		//Calls task(i) for every i below count and returns once all calls are done. Physics and the renderer both
+		//call it from their own threads, their loops take turns rather than share the helpers
+		void parallelFor(int count, const std::function<void(int)>& task);
+
+	private:
+		//Helper thread body, seen is the generation of the last loop before the helper started
+		void workerLoop(Uint64 seen);
+
+		//Claims indices of the current loop until none are left
+		void runTasks();
+
+		std::vector<std::thread> mThreads;
+		std::mutex mMutex;
+		std::condition_variable mWake, mFinished;
+
+		//Held by the thread whose loop is running, from setting it up until the helpers are done
+		std::mutex mCallerMutex;
+
+		//Current loop, a new generation wakes the helpers
+		const std::function<void(int)>* mTask;
+		int mCount;
+		std::atomic<int> mNext;
+
+		//Per node shares of the current loop, only used with more than one node
+		NumaTopology* mTopology;
+		int mNodes;
+		std::atomic<int> mNodeNext[NumaTopology::MAX_NODES];
+		int mNodeEnd[NumaTopology::MAX_NODES];
+		Uint64 mGeneration;
+		int mBusy;
+		bool mStopping;
+};
+
+//Draws a render snapshot by splitting the screen into tiles that the pool fills independently
+class TileRenderer{
+	public:
+		//How the balls end up on screen
+		enum Backend { BACKEND_SPRITES, BACKEND_GEOMETRY, BACKEND_SOFTWARE };
+
+		//Tile edge in pixels
+		static const int TILE_SIZE = 64;
+
+		//Initializes variables
+		TileRenderer();
+
+		//Frees the frame texture
+		~TileRenderer();
+
+		//Sizes the tiles for the screen
+		bool start(Backend backend, int width, int height);
+
+		//Draws every ball in the snapshot with the sprite level closest to its size
+		void render(const RenderSnapshot& snapshot, ThreadPool& pool, BallSprite& sprite);
+
+		//Releases the frame texture
+		void free();
+
+		Backend getBackend();
+
+		//Software backend frame from the last render, width*height ARGB8888 pixels
+		const Uint32* getPixels();
+
+	private:
+		//Counting sort of the balls into tiles, each pool task sorts one chunk of the snapshot
+		void bin(const RenderSnapshot& snapshot, ThreadPool& pool);
+
+		//Copies of a ball to draw, each a shift of -1, 0 or 1 world sizes along x and y packed as 4 + x + 3*y, so
+		//4 is the ball itself. A ball over an edge of a wrapped snapshot also gets the copies across that edge
+		int images(const RenderSnapshot& snapshot, const RenderBall& ball, int codes[4]);
+
+		//Screen position of one of a ball's copies
+		double imageX(const RenderSnapshot& snapshot, const RenderBall& ball, int code);
+		double imageY(const RenderSnapshot& snapshot, const RenderBall& ball, int code);
+
+		//Range of tiles a copy of a ball is binned into, the geometry backend only uses the center tile
+		void tileRange(const RenderSnapshot& snapshot, const RenderBall& ball, int code, int& column0, int& row0, int& column1, int& row1);
+
+		//Per tile work done on the pool
+		void buildGeometry(const RenderSnapshot& snapshot, BallSprite& sprite, int tile);
+		void rasterise(const RenderSnapshot& snapshot, BallSprite& sprite, int tile);
+
+		Backend mBackend;
+		int mWidth, mHeight;
+		int mColumns, mRows;
+
+		//Balls of tile t are mTileBalls[mTileStart[t]] up to mTileBalls[mTileStart[t + 1]], as 9*index + copy code
+		std::vector<int> mTileStart;
+		std::vector<int> mTileBalls;
+
+		//Tile counts per chunk, turned into write cursors after the prefix sum
+		std::vector<int> mChunkCounts;
+		int mChunks;
+
+		//Geometry backend vertex and index lists per tile, and the sprite level each tile is drawn with
+		std::vector< std::vector<SDL_Vertex> > mVertices;
+		std::vector< std::vector<int> > mIndices;
+		std::vector<int> mTileLevel;
+
+		//Software backend frame
+		std::vector<Uint32> mPixels;
+		SDL_Texture* mFrameTexture;
+};
+
+//Periodically sorts the ball arrays by position so neighbours sit close in memory
+class SpatialReorder{
+	public:
+		//Sort orders, grid cells row by row or a Z-order (Morton) curve
+		enum Key { KEY_CELLS, KEY_MORTON };
+
+		//Initializes variables
+		SpatialReorder();
+
+		//Reorders every interval steps, 0 tunes the interval from measured cost, -1 never reorders
+		void start(int interval, Key key);
+
+		//Brackets one physics step, reordering first when it is due
+		void beginStep(ThreadPool& pool);
+		void endStep();
+
+		//Sorts gBalls, gColliders, the registry and the grid by the sort key
+		void reorder(ThreadPool& pool);
+
+		int getReorders();
+
+	private:
+		//Interleaves the coordinates quantised to 16 bits, x in the even bits
+		static Uint32 mortonKey(double x, double y, double width, double height);
+
+		//Stable radix sort of mKeys carrying mOrder along, 8 bits a pass split into chunks on the pool,
+		//with only as many passes as maxKey needs
+		void radixSort(ThreadPool& pool, Uint32 maxKey);
+
+		int mInterval;
+		Key mKey;
+		int mReorders;
+		int mStepsSinceReorder;
+
+		//Keys and ball order being sorted, with the buffers each pass scatters into
+		std::vector<Uint32> mKeys, mKeysScratch;
+		std::vector<int> mOrder, mOrderScratch;
+		std::vector<int> mHistograms;
+
+		//Gather targets swapped with the live arrays
+		std::vector<Ball> mBallScratch;
+		std::vector<Circle> mColliderScratch;
+
+		//Cache misses of the stepping thread when the kernel has counters, otherwise time is used
+		PerfCounters mCounters;
+		bool mCountersTried, mCountersOpen;
+		std::chrono::steady_clock::time_point mStepStart;
+
+		//Cost of the last reorder, 0 until one has been timed
+		double mReorderUs;
+
+		//Smoothed per-ball step cost, the best it has been since the reorder and the time paid above that
+		double mCost;
+		double mBaseline;
+		double mExcessUs;
+		double mLastStepUs;
+};
+
+//Bounces touching balls apart after they moved, splitting the contacts into islands of balls that touch
+//each other so islands can be solved at the same time
+class ContactSolver{
+	public:
+		//Islands with more contacts than this are coloured so their own contacts can be spread over the pool
+		static const int GIANT_ISLAND = 256;
+
+		//Balls scanned and contacts solved per pool task
+		static const int CHUNK_SIZE = 1024;
+
+		//Initializes variables
+		ContactSolver();
+
+		//Finds the contacts of the first count balls with any ball and resolves them
+		void solve(ThreadPool& pool, int count);
+
+	private:
+		//Two touching balls, a is one of the balls being stepped
+		struct Contact{
+			int a, b;
+		};
+
+		//Contacts and counters found by one detection task
+		struct Chunk{
+			std::vector<Contact> contacts;
+			int pairs;
+			double overlap;
+		};
+
+		//Grid search of every stepped ball, concatenated in ball order so the result does not depend on the threads
+		void findContacts(ThreadPool& pool, int count);
+
+		//Union-find over the balls, the lower index always becomes the root
+		int findRoot(int ball);
+		void join(int a, int b);
+
+		//Groups the contacts by island, keeping their order inside each island
+		void buildIslands();
+
+		//Splits an island into sets of contacts that share no ball and solves a set at a time
+		void solveGiant(ThreadPool& pool, int island);
+
+		std::vector<Chunk> mChunks;
+		std::vector<Contact> mContacts;
+
+		//Union-find parent and island number of each ball
+		std::vector<int> mParent;
+		std::vector<int> mIslandOf;
+
+		//Contacts sorted by island, with each island's start, and the islands too small to split
+		std::vector<Contact> mSorted;
+		std::vector<int> mIslandStart;
+		std::vector<int> mSmall;
+
+		//Contacts that bounced this substep, summed once per task
+		std::atomic<int> mCollisions;
+
+		//Colours taken at each ball and the giant island's contacts sorted by colour
+		std::vector<Uint64> mUsedColours;
+		std::vector<int> mColourOf;
+		std::vector<int> mColourStart;
+		std::vector<Contact> mColoured;
+};
+
+//Many small independent box tables stepped in one process for parameter sweeps. Tables of similar size are
+//packed LANES to a batch with ball i of every table side by side, so the move and the walls run as SIMD across
+//tables, and the thread pool hands out whole batches
+class Ensemble{
+	public:
+		//Tables per batch, one per SIMD lane of an AVX-512 register of doubles
+		static const int LANES = 8;
+
+		//Initializes variables
+		Ensemble();
+
+		//Reads the tables from a spec file, one "seed balls [width height [speed [gravity [dt]]]]" line per table
+		bool load(std::string path);
+
+		//Steps every table and writes one summary row per table to outputPath
+		bool run(ThreadPool& pool, int steps, std::string outputPath);
+
+	private:
+		//One table of the sweep
+		struct Table{
+			unsigned int seed;
+			int balls;
+			double width, height;
+			double speed, gravity, dt;
+		};
+
+		//Up to LANES tables, ball slot i of lane t lives at i*LANES + t. Lanes with fewer balls are padded
+		//with resting balls that nothing touches
+		struct Batch{
+			int tables;
+			int slots;
+			int table[LANES];
+			int count[LANES];
+			double width[LANES], height[LANES], gravity[LANES], dt[LANES];
+			std::vector<double> x, y, velX, velY;
+
+			//Slots of each lane sorted by x for the contact sweep, kept from step to step
+			std::vector<int> order[LANES];
+
+			//Totals over the run
+			double startEnergy[LANES];
+			double wallImpulse[LANES];
+			Uint64 collisions[LANES];
+			Uint64 substeps[LANES];
+			double wallMs;
+		};
+
+		//Columns and rows of the starting lattice inside the walls, false if a cell is smaller than a ball
+		static bool latticeShape(const Table& table, int& columns, int& rows);
+
+		//Puts a table's balls in a lane on a jittered lattice with random directions, from the table's seed
+		void fill(Batch& batch, int lane, const Table& table);
+
+		//Advances every lane of a batch by one step
+		void step(Batch& batch);
+
+		//Substeps that keep each lane's fastest ball under substepFraction radii per substep, the most of any lane returned
+		int substepsNeeded(Batch& batch, int substeps[LANES]);
+
+		//Velocity Verlet and wall reflection of substep s for every slot of every lane, the SIMD pass. Lanes that
+		//already took all their substeps move by zero, so a table steps the same whatever batch it is in
+		void move(Batch& batch, int s, const int substeps[LANES]);
+
+		//Sort and sweep along x through one lane, bouncing balls that touch and close in
+		void collide(Batch& batch, int lane);
+
+		//Kinetic plus potential energy of a lane, potential measured from the bottom edge like the monitor
+		double energy(Batch& batch, int lane);
+
+		//Writes a lane's summary row
+		void writeRow(FILE* file, Batch& batch, int lane, int steps);
+
+		std::vector<Table> mTables;
+		std::vector<Batch> mBatches;
+};
+
+//Runs frame stage coroutines on the main thread or on the simulation worker
+class FrameScheduler{
+	public:
+		//Threads a stage can run on
+		enum Executor { MAIN_THREAD, WORKER_THREAD };
+
+		//Awaitable that moves the awaiting coroutine to a thread
+		struct Switch{
+			FrameScheduler* scheduler;
+			Executor executor;
+			bool await_ready(){ return false; }
+			void await_suspend(std::coroutine_handle<> handle){ scheduler->post(executor, handle); }
+			void await_resume(){}
+		};
+
+		//Initializes variables
+		FrameScheduler();
+
+		//Stops the worker if still running
+		~FrameScheduler();
+
+		//Starts and joins the worker thread
+		void start();
+		void stop();
+
+		//Queues a coroutine to be resumed on a thread
+		void post(Executor executor, std::coroutine_handle<> handle);
+
+		//Resumes one coroutine queued for the main thread, waiting for one if needed
+		void runMainOnce();
+
+		//co_await on(executor) continues the coroutine on that thread
+		Switch on(Executor executor);
+
+	private:
+		//Worker thread body
+		void workerLoop();
+
+		std::mutex mMutex;
+		std::condition_variable mMainReady, mWorkerReady;
+		std::deque< std::coroutine_handle<> > mMainQueue, mWorkerQueue;
+		std::thread mWorker;
+		bool mStopping;
+};
+
+//One-shot signal that a stage of a frame has finished
+class StageEvent{
+	public:
+		//Awaitable that continues on a thread once the event is set
+		struct Waiter{
+			StageEvent* event;
+			FrameScheduler::Executor executor;
+			bool await_ready(){ return false; }
+			void await_suspend(std::coroutine_handle<> handle);
+			void await_resume(){}
+		};
+
+		//Initializes variables
+		StageEvent();
+
+		//Marks the stage finished and releases everyone waiting on it
+		void set();
+
+		//co_await wait(executor) continues on that thread after set()
+		Waiter wait(FrameScheduler::Executor executor);
+
+	private:
+		std::mutex mMutex;
+		bool mSet;
+		std::vector< std::pair<std::coroutine_handle<>, FrameScheduler::Executor> > mWaiters;
+};
+
+//Coroutine running every stage of one frame, left suspended at the end for the driver to destroy
+class FrameTask{
+	public:
+		struct promise_type{
+			FrameTask get_return_object(){ return FrameTask(std::coroutine_handle<promise_type>::from_promise(*this)); }
+			std::suspend_always initial_suspend(){ return std::suspend_always(); }
+			std::suspend_always final_suspend() noexcept { return std::suspend_always(); }
+			void return_void(){}
+			void unhandled_exception(){ std::terminate(); }
+		};
+
+		FrameTask(std::coroutine_handle<promise_type> handle);
+		FrameTask(FrameTask&& other);
+		~FrameTask();
+
+		//Runs the frame up to its first suspension point
+		void resume();
+
+		bool done();
+
+	private:
+		std::coroutine_handle<promise_type> mHandle;
+};
+
+//Change to the simulation requested by the user, applied at the start of a physics step
+struct InputCommand{
+	enum Type { SPAWN, ATTRACT, ADD_BALLS, REMOVE_BALLS, SCALE_SPEED };
+	Type type;
+
+	//Cursor position for SPAWN and ATTRACT
+	double x, y;
+
+	//Ball count for SPAWN. ADD_BALLS and REMOVE_BALLS change a tenth of the balls, counted when the command is applied
+	int count;
+
+	//Speed multiplier for SCALE_SPEED
+	double factor;
+};
+
+//Everything one frame carries through the pipeline
+struct FrameContext{
+	Uint64 index;
+	StepStats stats;
+
+	//Input gathered on the main thread for this frame's physics step
+	std::vector<InputCommand> commands;
+
+	//Run several physics steps before presenting, and the step count reached
+	bool fastForward;
+	Uint64 step;
+
+	//Snapshot of the balls for the present stage
+	RenderSnapshot drawList;
+
+	//Set when the stages later frames depend on have finished
+	std::shared_ptr<StageEvent> drawListReady;
+	std::shared_ptr<StageEvent> presented;
+};
+
+//Runs a frame's queued commands against gBalls
+void applyCommands(const std::vector<InputCommand>& commands);
+
+//Advances the simulation one step, timing its phases into the frame when asked
+void stepSimulation(FrameContext& frame, bool timePhases);
+
+//Frame stages, in dependency order
+void handleInput(FrameContext& frame);
+void simulateFrame(FrameContext& frame);
+void buildDrawList(FrameContext& frame);
+void presentFrame(FrameContext& frame);
+void recordFrame(FrameContext& frame);
+void flushTelemetry(FrameContext& frame);
+
+//Runs one frame's stages, after the previous frame's draw list and present
+FrameTask runFrame(FrameContext& frame, std::shared_ptr<StageEvent> previousDrawList, std::shared_ptr<StageEvent> previousPresented);
+
+//Command line configurable settings
+struct Settings{
+	//Frame capture output, empty when capture is off
+	std::string capturePath;
+	FrameCapture::Format captureFormat;
+	FrameCapture::Policy capturePolicy;
+	int captureBuffers;
+
+	//Number of worker processes, 0 keeps the simulation in process
+	int domains;
+
+	//Telemetry export prefix, empty when telemetry is off
+	std::string telemetryPrefix;
+	int telemetrySteps;
+
+	//Conservation monitor and its relative drift tolerance
+	bool monitor;
+	double monitorTolerance;
+
+	//Gas observables output prefix, empty when off, and the steps between rows
+	std::string observablesPrefix;
+	int observablesEvery;
+
+	//Largest move per substep as a fraction of the radius, 0 disables substepping
+	double substepFraction;
+
+	//Simulated seconds per physics step, and the pull down the table in pixels per second squared
+	double dt;
+	double gravity;
+
+	//Billiard table with pockets instead of the plain box, or edges that wrap around instead of walls
+	bool billiardTable;
+	bool periodicTable;
+
+	//Balls spawned per frame while the left mouse button is held
+	int spawnRate;
+
+	//Snapshot recording output, empty when recording is off
+	std::string recordPath;
+
+	//Shared memory segment name, empty when the state is not published, and the balls it first holds
+	std::string shareName;
+	int shareCapacity;
+
+	//Ball drawing backend and the helper threads it may use
+	TileRenderer::Backend renderer;
+	int threads;
+
+	//Helper threads pinned to NUMA nodes with each node's share of the balls in its own memory, instead of one flat array
+	bool numaLocal;
+
+	//Spatial reorder interval in steps, 0 tunes it, -1 turns reordering off, and the order sorted into
+	int reorderInterval;
+	SpatialReorder::Key reorderKey;
+
+	//Fast-forward at startup, presenting every fastForwardSteps steps or presentRate times a second
+	bool fastForward;
+	int fastForwardSteps;
+	double presentRate;
+
+	//Scaling benchmark output prefix, empty for the normal interactive run
+	std::string benchmarkPrefix;
+	std::vector<int> benchmarkSizes;
+	std::vector<double> benchmarkDensities;
+	std::vector<int> benchmarkThreads;
+
+	//Ball-steps each benchmark run aims for
+	double benchmarkWork;
+
+	//Regression check against a golden file, empty for the normal run, whether to rewrite the file instead,
+	//whether a slowdown fails it, and the slowdown allowed before it does
+	std::string regressPath;
+	bool regressUpdate;
+	bool regressTiming;
+	double regressTolerance;
+
+	//Ensemble spec file, empty for the normal run, the steps every table takes and the summary it writes
+	std::string ensemblePath;
+	int ensembleSteps;
+	std::string ensembleOutput;
+};
+
+//Puts every setting in gSettings back to its default
+void setDefaultSettings();
+
+//Reads command line options into gSettings
+bool parseArgs(int argc, char* args[]);
+
+//Reads a comma separated list of numbers
+template <typename T>
+bool parseList(const char* text, std::vector<T>& values);
+
+//Runs the scaling sweep without a window and writes prefix.csv and prefix.gp
+bool runBenchmark();
+
+//Fills the world with n balls on a jittered lattice
+void loadBenchmarkBalls(int n);
+
+//Runs the canonical scenes without a window and compares state hashes and step times with the golden file
+bool runRegression();
+
+//FNV-1a hash of the count, positions and velocities of gBalls in array order
+Uint64 hashBalls();
+
+//Starts up SDL and creates window
+bool init();
+
+//Loads media
+bool loadMedia();
+
+//Frees media and shuts down SDL
+void close();
+
+//Load balls in a vector
+void loadBalls(int n);
+
+//Appends a ball to gBalls, the registry and the grid
+BallHandle spawnBall(const Ball& ball);
+
+//Swap-and-pop removal of a ball, fails for a stale handle
+bool despawnBall(BallHandle handle);
+
+//Removes every ball and sizes the grid for the table
+void clearBalls();
+
+//Despawns balls that dropped into a pocket this step
+void removePocketedBalls();
+
+//Circle/Circle collision detector
+bool checkCollision(Circle& a, Circle& b);
+
+//Calculates the distance between two points, to the nearest image on a periodic table
+double distance(double x1, double y1, double x2, double y2);
+
+//responsible for transfer of velocities from each other, true if the balls were closing in and bounced
+bool calculateNewVel(Ball& curBall, Ball& otherBall);
+
+//Substeps that keep the fastest of the first count balls under substepFraction radii per substep
+int substepsNeeded(int count);
+
+//Moves the first count balls through a substep of h seconds, bounces them off the table and relinks them in the grid
+void moveBalls(int count, double h);
+
+//pushes the balls away if animated on top of each otehr
+void nudgeBallLoop();
+
+void nudgeBallMath(Circle& curBall, Circle& otherBall);
+
+//The window and everything drawn to it, only in the program
+#ifndef BOUNCING_BALL_LIBRARY
+//The window we'll be rendering to
+SDL_Window* gWindow = NULL;
+
+//The window renderer
+SDL_Renderer* gRenderer = NULL;
+
+//Global Timer
+LTimer gTimer;
+
+//Ball sprite levels, drawn at startup
+BallSprite gBallSprite;
+
+//Globally used font, opened in the background
+AsyncFont gFont;
+
+//Scene textures
+LTexture gFPSTextTexture;
+
+//Frame capture pipeline
+FrameCapture gCapture;
+
+//Ball drawing for the geometry and software backends
+TileRenderer gTileRenderer;
+
+//Runs the frame stages
+FrameScheduler gScheduler;
+
+//Frames presented and the timer they are averaged over
+int gCountedFrames = 0;
+LTimer gFPSTimer;
+#endif
+
+//Vector for the balls
+vector<Ball> gBalls;
+vector<Circle> gColliders;
+
+//Settings from the command line
+Settings gSettings;
+
+//Per-step render snapshot recording
+SnapshotRecorder gRecorder;
+
+//Per-step state published to other processes
+SharedStateExport gShare;
+
+//NUMA layout of the machine, read with --numa local
+NumaTopology gNuma;
+
+//Helper threads shared by the parallel passes
+ThreadPool gThreadPool;
+
+//Keeps gBalls in spatial order
+SpatialReorder gReorder;
+
+//Ball-ball contacts of each substep
+ContactSolver gContacts;
+
+//Independent tables stepped with --ensemble
+Ensemble gEnsemble;
+
+//Multi-process simulation, used when --domains is given
+DomainSimulation gDomains;
+
+//Per-step counters and timings
+Telemetry gTelemetry;
+
+//Energy, momentum and overlap checks
+ConservationMonitor gMonitor;
+
+//Gas observables written with --observables
+GasObservables gObservables;
+
+//Cushions and pockets around the table
+TableGeometry gTable;
+
+//Handles and broadphase for the balls in gBalls
+BallRegistry gRegistry;
+SpatialGrid gGrid;
+
+//Set by any stage to end the main loop
+std::atomic<bool> gQuit(false);
+
+//Mouse state carried between input stages
+int gMouseX = 0, gMouseY = 0;
+bool gSpawning = false, gAttracting = false;
+
+//Speed given to spawned balls in pixels per second, changed at runtime with the +/- keys
+double gSpawnSpeed = 240;
+
+//Size of the table the balls live on, the screen unless a benchmark grows it
+double gWorldWidth = SCREEN_WIDTH;
+double gWorldHeight = SCREEN_HEIGHT;
+
+//Fast-forward state, toggled at runtime with F
+bool gFastForward = false;
+
+//Physics steps taken, only advanced by the simulate stage
+Uint64 gSteps = 0;
+
+//Set while a World owns the globals above
+bool gWorldStarted = false;
+
+//Simulated steps per second shown in the overlay and the window it is measured over
+double gStepsPerSecond = 0;
+Uint64 gRateSteps = 0;
+Uint32 gRateTicks = 0;
+
+}
+using namespace bouncingball;
+
+//The library build leaves main to the program embedding it
+#ifndef BOUNCING_BALL_LIBRARY
+int main( int argc, char* args[] ){
+	//Read command line options
+	if(!parseArgs(argc, args)){
+		return 1;
+	}
+
+	//Find the nodes before any helper thread starts
+	if(gSettings.numaLocal){
+		gNuma.discover();
+	}
+
+	//The benchmark and the regression check run headless and exit
+	if(!gSettings.benchmarkPrefix.empty()){
+		return runBenchmark() ? 0 : 1;
+	}
+	if(!gSettings.regressPath.empty()){
+		return runRegression() ? 0 : 1;
+	}
+	if(!gSettings.ensemblePath.empty()){
+		if(!gEnsemble.load(gSettings.ensemblePath)){
+			return 1;
+		}
+		gThreadPool.start(gSettings.threads, gSettings.numaLocal ? &gNuma : NULL);
+		bool success = gEnsemble.run(gThreadPool, gSettings.ensembleSteps, gSettings.ensembleOutput);
+		gThreadPool.stop();
+		return success ? 0 : 1;
+	}
+
+	//Start up SDL and create window
+	if(!init()){
+		printf( "Failed to initialize!\n" );
+	}
+	else{
+		//Load media
+		if(!loadMedia()){
+			printf( "Failed to load media!\n" );
+		}
+		else{
+			//Start global timer
+			gTimer.start();
+
+			//Count of balls in screen
+			int nBalls = 50;
+
+			//Lay out the table before the balls go on it
+			if(gSettings.billiardTable){
+				gTable.buildBilliard(gWorldWidth, gWorldHeight, Ball::BALL_WIDTH);
+			}
+			else if(gSettings.periodicTable){
+				gTable.buildPeriodic(gWorldWidth, gWorldHeight);
+			}
+			else{
+				gTable.buildBox(gWorldWidth, gWorldHeight);
+			}
+
+			//loadBalls in vector gBalls
+			clearBalls();
+			loadBalls(nBalls);
+
+			nudgeBallLoop();
+
+			//Hand the balls to worker processes before this process starts any thread of its own, the font loader included.
+			//Strips only trade balls with their neighbours, so nothing could cross the wrapped edge between the first and the last
+			if(gSettings.domains > 0 && gSettings.periodicTable){
+				printf("Periodic edges need the in-process simulation, ignoring --domains with --table periodic\n");
+			}
+			else if(gSettings.domains > 0){
+				if(!gDomains.start(gSettings.domains)){
+					printf("Failed to start domain workers!\n");
+					gQuit = true;
+				}
+			}
+
+			//The overlay font opens in the background once the workers are forked, a missing font only costs the overlay
+			gFont.load("consola.ttf", 15);
+
+			//Start recording per-step telemetry if requested
+			if(!gSettings.telemetryPrefix.empty()){
+				gTelemetry.start(gSettings.telemetrySteps, 1000000.0/60);
+			}
+
+			//Start the gas observables if requested, they need the wall and collision counts of an in-process run
+			if(!gSettings.observablesPrefix.empty()){
+				if(gDomains.isRunning()){
+					printf("Gas observables need the in-process simulation, ignoring --observables with --domains\n");
+				}
+				else if(!gObservables.start(gSettings.observablesPrefix, gSettings.observablesEvery)){
+					printf("Failed to start the gas observables!\n");
+				}
+			}
+
+			//Start the invariant checks if requested, wall impulses stay inside domain workers
+			if(gSettings.monitor){
+				gMonitor.start(gSettings.monitorTolerance, Ball::BALL_WIDTH/4.0, !gDomains.isRunning());
+			}
+
+			//Start the frame capture writer if requested
+			if(!gSettings.capturePath.empty()){
+				if(!gCapture.start(gSettings.capturePath, SCREEN_WIDTH, SCREEN_HEIGHT, 60, gSettings.captureFormat, gSettings.capturePolicy, gSettings.captureBuffers)){
+					printf("Failed to start frame capture!\n");
+				}
+			}
+
+			//Start the snapshot recorder if requested
+			if(!gSettings.recordPath.empty()){
+				if(!gRecorder.start(gSettings.recordPath, SCREEN_WIDTH, SCREEN_HEIGHT)){
+					printf("Failed to start snapshot recording!\n");
+				}
+			}
+
+			//Publish the state to other processes if requested
+			if(!gSettings.shareName.empty()){
+				if(!gShare.start(gSettings.shareName, gSettings.shareCapacity, gWorldWidth, gWorldHeight)){
+					printf("Failed to start the shared memory export!\n");
+				}
+			}
+
+			//Start the helper threads, the reorder pass and the tiled renderer
+			gThreadPool.start(gSettings.threads, gSettings.numaLocal ? &gNuma : NULL);
+			gReorder.start(gSettings.reorderInterval, gSettings.reorderKey);
+			if(!gTileRenderer.start(gSettings.renderer, SCREEN_WIDTH, SCREEN_HEIGHT)){
+				printf("Failed to start the renderer, falling back to sprites!\n");
+				gTileRenderer.start(TileRenderer::BACKEND_SPRITES, SCREEN_WIDTH, SCREEN_HEIGHT);
+			}
+
+			//Start counting frames per second
+			gFastForward = gSettings.fastForward;
+			gCountedFrames = 0;
+			gFPSTimer.start();
+			gScheduler.start();
+
+			//One frame presenting, the next simulating and the last flushing its telemetry
+			const int FRAMES_IN_FLIGHT = 3;
+			FrameContext frames[FRAMES_IN_FLIGHT];
+			FrameTask* tasks[FRAMES_IN_FLIGHT] = { NULL, NULL, NULL };
+			std::shared_ptr<StageEvent> lastDrawList, lastPresented;
+			Uint64 nextFrame = 0;
+
+			//While application is running or frames are still in flight
+			while(true){
+				//Launch a frame as soon as its slot is free
+				int slot = nextFrame % FRAMES_IN_FLIGHT;
+				if(!gQuit && tasks[slot] == NULL){
+					FrameContext& frame = frames[slot];
+					frame.index = nextFrame++;
+					frame.drawListReady = std::make_shared<StageEvent>();
+					frame.presented = std::make_shared<StageEvent>();
+					tasks[slot] = new FrameTask(runFrame(frame, lastDrawList, lastPresented));
+					lastDrawList = frame.drawListReady;
+					lastPresented = frame.presented;
+
+					//Input runs right here on the main thread
+					tasks[slot]->resume();
+					continue;
+				}
+				bool inFlight = false;
+				for(int i = 0; i < FRAMES_IN_FLIGHT; i++){
+					inFlight = inFlight || tasks[i] != NULL;
+				}
+				if(!inFlight){
+					break;
+				}
+
+				//Run main thread stages, then reap frames that have finished
+				gScheduler.runMainOnce();
+				for(int i = 0; i < FRAMES_IN_FLIGHT; i++){
+					if(tasks[i] != NULL && tasks[i]->done()){
+						delete tasks[i];
+						tasks[i] = NULL;
+					}
+				}
+			}
+
+			gScheduler.stop();
+
+			//Flush remaining frames to disk
+			gCapture.stop();
+			gRecorder.stop();
+			gShare.stop();
+			gThreadPool.stop();
+			gTileRenderer.free();
+
+			//Shut down the workers
+			gDomains.stop();
+
+			//Summarise the invariant checks
+			if(gMonitor.isEnabled()){
+				gMonitor.report();
+			}
+			gObservables.stop();
+
+			//Write out the recorded telemetry
+			if(gTelemetry.isEnabled()){
+				std::string prefix = gSettings.telemetryPrefix;
+				if(!gTelemetry.exportCSV(prefix + ".csv") || !gTelemetry.exportJSON(prefix + ".json") || !gTelemetry.exportChromeTrace(prefix + ".trace.json")){
+					printf("Failed to write telemetry to %s.*!\n", prefix.c_str());
+				}
+			}
+		}
+	}
+	//Free resources and close SDL
+	close();
+	return 0;
+}
+#endif
+
+namespace bouncingball{
+
+//Frame stages of the window loop, a World calls stepSimulation directly
+#ifndef BOUNCING_BALL_LIBRARY
+FrameTask runFrame(FrameContext& frame, std::shared_ptr<StageEvent> previousDrawList, std::shared_ptr<StageEvent> previousPresented){
+	//Input runs on the main thread as soon as the frame is launched
+	handleInput(frame);
+
+	//Simulation waits for the previous frame to copy out its draw list
+	if(previousDrawList){
+		co_await previousDrawList->wait(FrameScheduler::WORKER_THREAD);
+	}
+	else{
+		co_await gScheduler.on(FrameScheduler::WORKER_THREAD);
+	}
+	simulateFrame(frame);
+	buildDrawList(frame);
+	frame.drawListReady->set();
+
+	//Frames are presented in order on the thread that owns the renderer
+	if(previousPresented){
+		co_await previousPresented->wait(FrameScheduler::MAIN_THREAD);
+	}
+	else{
+		co_await gScheduler.on(FrameScheduler::MAIN_THREAD);
+	}
+	presentFrame(frame);
+	frame.presented->set();
+
+	//Recording and telemetry are flushed off the main thread
+	co_await gScheduler.on(FrameScheduler::WORKER_THREAD);
+	recordFrame(frame);
+	flushTelemetry(frame);
+
+	//Finish on the main thread, where the driver reaps frames
+	co_await gScheduler.on(FrameScheduler::MAIN_THREAD);
+}
+
+void handleInput(FrameContext& frame){
+	gTelemetry.beginStep(frame.stats, frame.index);
+	gTelemetry.beginPhase(frame.stats, Telemetry::PHASE_INPUT);
+
+	//Events only queue commands, the physics applies them all at once
+	frame.commands.clear();
+	InputCommand command;
+	memset(&command, 0, sizeof(command));
+
+	//Handle events on queue
+	SDL_Event e;
+	while(SDL_PollEvent(&e) != 0){
+		//User requests quit
+		if(e.type == SDL_QUIT){
+			gQuit = true;
+		}
+		else if(e.type == SDL_MOUSEMOTION){
+			gMouseX = e.motion.x;
+			gMouseY = e.motion.y;
+			gSpawning = (e.motion.state & SDL_BUTTON_LMASK) != 0;
+			gAttracting = (e.motion.state & SDL_BUTTON_RMASK) != 0;
+		}
+		else if(e.type == SDL_MOUSEBUTTONDOWN || e.type == SDL_MOUSEBUTTONUP){
+			gMouseX = e.button.x;
+			gMouseY = e.button.y;
+			bool down = e.type == SDL_MOUSEBUTTONDOWN;
+			if(e.button.button == SDL_BUTTON_LEFT){
+				gSpawning = down;
+			}
+			else if(e.button.button == SDL_BUTTON_RIGHT){
+				gAttracting = down;
+			}
+		}
+		else if(e.type == SDL_KEYDOWN){
+			//Up and down change the ball count, plus and minus the speed
+			switch(e.key.keysym.sym){
+				case SDLK_UP:
+					command.type = InputCommand::ADD_BALLS;
+					frame.commands.push_back(command);
+					break;
+				case SDLK_DOWN:
+					command.type = InputCommand::REMOVE_BALLS;
+					frame.commands.push_back(command);
+					break;
+				case SDLK_EQUALS:
+				case SDLK_PLUS:
+				case SDLK_KP_PLUS:
+					command.type = InputCommand::SCALE_SPEED;
+					command.factor = 1.25;
+					frame.commands.push_back(command);
+					break;
+				case SDLK_MINUS:
+				case SDLK_KP_MINUS:
+					command.type = InputCommand::SCALE_SPEED;
+					command.factor = 0.8;
+					frame.commands.push_back(command);
+					break;
+				case SDLK_f:
+					gFastForward = !gFastForward;
+					break;
+			}
+		}
+	}
+
+	//Held buttons act once per frame however many motion events arrived
+	if(gSpawning){
+		command.type = InputCommand::SPAWN;
+		command.x = gMouseX;
+		command.y = gMouseY;
+		command.count = gSettings.spawnRate;
+		frame.commands.push_back(command);
+	}
+	if(gAttracting){
+		command.type = InputCommand::ATTRACT;
+		command.x = gMouseX;
+		command.y = gMouseY;
+		frame.commands.push_back(command);
+	}
+
+	frame.fastForward = gFastForward;
+
+	gTelemetry.endPhase(frame.stats, Telemetry::PHASE_INPUT);
+}
+
+void simulateFrame(FrameContext& frame){
+	//The frame's counters are its edits plus every step it took
+	gTelemetry.current = StepCounters();
+
+	//Balls belong to the domain workers in multi-process mode
+	if(!gDomains.isRunning()){
+		applyCommands(frame.commands);
+	}
+	frame.stats.counters = gTelemetry.current;
+
+	if(!frame.fastForward){
+		stepSimulation(frame, true);
+		frame.stats.counters.add(gTelemetry.current);
+	}
+	else{
+		//Step flat out until enough steps are done or it is time to present, timed as one move phase
+		gTelemetry.beginPhase(frame.stats, Telemetry::PHASE_MOVE);
+		std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now();
+		if(gSettings.presentRate > 0){
+			deadline += std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1/gSettings.presentRate));
+		}
+		int steps = 0;
+		do{
+			stepSimulation(frame, false);
+			frame.stats.counters.add(gTelemetry.current);
+			steps++;
+		}while(!gQuit && (gSettings.fastForwardSteps <= 0 || steps < gSettings.fastForwardSteps) && (gSettings.presentRate <= 0 || std::chrono::steady_clock::now() < deadline));
+		gTelemetry.endPhase(frame.stats, Telemetry::PHASE_MOVE);
+	}
+
+	frame.step = gSteps;
+}
+#endif
+
+void stepSimulation(FrameContext& frame, bool timePhases){
+	std::chrono::steady_clock::time_point stepStart = std::chrono::steady_clock::now();
+	gTelemetry.current = StepCounters();
+	if(!gDomains.isRunning()){
+		gReorder.beginStep(gThreadPool);
+
+		//Keep each node's share of the arrays on that node, only does work after they moved or changed size
+		if(gSettings.numaLocal){
+			gNuma.place(gBalls.data(), gBalls.size()*sizeof(Ball));
+			gNuma.place(gColliders.data(), gColliders.size()*sizeof(Circle));
+		}
+	}
+	if(gDomains.isRunning()){
+		//Workers move the balls and hand back the merged result
+		if(timePhases){
+			gTelemetry.beginPhase(frame.stats, Telemetry::PHASE_MOVE);
+		}
+		if(!gDomains.step()){
+			printf("Lost contact with domain workers!\n");
+			gQuit = true;
+		}
+		if(timePhases){
+			gTelemetry.endPhase(frame.stats, Telemetry::PHASE_MOVE);
+		}
+	}
+	else{
+		if(timePhases){
+			gTelemetry.beginPhase(frame.stats, Telemetry::PHASE_NUDGE);
+		}
+		nudgeBallLoop();
+		if(timePhases){
+			gTelemetry.endPhase(frame.stats, Telemetry::PHASE_NUDGE);
+			gTelemetry.beginPhase(frame.stats, Telemetry::PHASE_MOVE);
+		}
+
+		//Move the balls inside the vector gBalls, checking contacts after every substep
+		int substeps = substepsNeeded(gBalls.size());
+		for(int step = 0; step < substeps; step++){
+			moveBalls(gBalls.size(), gSettings.dt / substeps);
+			gContacts.solve(gThreadPool, gBalls.size());
+		}
+
+		//Pocketed balls leave once nothing is iterating over the arrays
+		removePocketedBalls();
+		if(timePhases){
+			gTelemetry.endPhase(frame.stats, Telemetry::PHASE_MOVE);
+		}
+		gReorder.endStep();
+	}
+
+	//Check the invariants on the new state
+	if(gMonitor.isEnabled()){
+		gMonitor.addStepTime(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - stepStart).count());
+		gMonitor.check(gSteps);
+	}
+
+	if(gObservables.isEnabled()){
+		gObservables.endStep(gSteps);
+	}
+
+	//Readers see each step as soon as it is complete
+	if(gShare.isRunning()){
+		gShare.publish(gSteps, (gSteps + 1)*gSettings.dt);
+	}
+	gSteps++;
+}
+
+//Input, drawing and the textures behind it need SDL, which the library does not link
+#ifndef BOUNCING_BALL_LIBRARY
+void applyCommands(const std::vector<InputCommand>& commands){
+	//User edits are not physics, so the invariants restart from the edited state
+	if(!commands.empty() && gMonitor.isEnabled()){
+		gMonitor.resetReference();
+	}
+
+	for(int c = 0; c < commands.size(); c++){
+		const InputCommand& command = commands[c];
+
+		//Only this thread touches gBalls, so the tenth for the arrow keys is counted here and not at input
+		int tenth = gBalls.size() > 100 ? gBalls.size()/10 : 10;
+		switch(command.type){
+			case InputCommand::SPAWN:
+			case InputCommand::ADD_BALLS:
+				for(int i = 0; i < (command.type == InputCommand::SPAWN ? command.count : tenth); i++){
+					//Spawns scatter around the cursor, added balls anywhere on the table
+					double x, y;
+					if(command.type == InputCommand::SPAWN){
+						x = command.x + (rand()%41 - 20);
+						y = command.y + (rand()%41 - 20);
+					}
+					else{
+						x = Ball::BALL_WIDTH + (gWorldWidth - 2*Ball::BALL_WIDTH)*(rand()/(RAND_MAX + 1.0));
+						y = Ball::BALL_HEIGHT + (gWorldHeight - 2*Ball::BALL_HEIGHT)*(rand()/(RAND_MAX + 1.0));
+					}
+					double angle = 2*PI*(rand()/(RAND_MAX + 1.0));
+
+					Ball ball(0, 0, 0, 0);
+					BallState state = ball.getState();
+					state.posX = x;
+					state.posY = y;
+					state.velX = gSpawnSpeed*cos(angle);
+					state.velY = gSpawnSpeed*sin(angle);
+					ball.setState(state);
+					spawnBall(ball);
+				}
+				break;
+
+			case InputCommand::REMOVE_BALLS:
+				for(int i = 0; i < tenth && !gBalls.empty(); i++){
+					despawnBall(gRegistry.handleAt(rand()%gBalls.size()));
+				}
+				break;
+
+			case InputCommand::ATTRACT:
+				//Pull every ball toward the cursor without letting it outrun the spawn speed by much
+				for(int i = 0; i < gBalls.size(); i++){
+					BallState state = gBalls[i].getState();
+					double dx = command.x - state.posX, dy = command.y - state.posY;
+					double dist = sqrt(dx*dx + dy*dy);
+					if(dist < 1){
+						continue;
+					}
+					state.velX += 12*dx/dist;
+					state.velY += 12*dy/dist;
+					double speed = sqrt(state.velX*state.velX + state.velY*state.velY);
+					if(speed > 2*gSpawnSpeed){
+						state.velX *= 2*gSpawnSpeed/speed;
+						state.velY *= 2*gSpawnSpeed/speed;
+					}
+					gBalls[i].mVelX = state.velX;
+					gBalls[i].mVelY = state.velY;
+				}
+				break;
+
+			case InputCommand::SCALE_SPEED:
+				gSpawnSpeed *= command.factor;
+				for(int i = 0; i < gBalls.size(); i++){
+					gBalls[i].mVelX *= command.factor;
+					gBalls[i].mVelY *= command.factor;
+				}
+				break;
+		}
+	}
+}
+
+void buildDrawList(FrameContext& frame){
+	//Copy out what the present stage needs so the next step can start on gBalls
+	gTelemetry.beginPhase(frame.stats, Telemetry::PHASE_DRAW_LIST);
+	frame.drawList.pack(gBalls, gRegistry, gWorldWidth, gWorldHeight, gSettings.billiardTable && !gDomains.isRunning(), gTable.isPeriodic());
+	gTelemetry.endPhase(frame.stats, Telemetry::PHASE_DRAW_LIST);
+}
+
+void presentFrame(FrameContext& frame){
+	//Clear screen
+	SDL_SetRenderDrawColor(gRenderer, 0xFF, 0xFF, 0xFF, 0xFF);
+	SDL_RenderClear(gRenderer);
+
+	//Calculate and correct fps
+	gTelemetry.beginPhase(frame.stats, Telemetry::PHASE_OVERLAY);
+	float avgFPS = gCountedFrames/(gFPSTimer.getTicks()/1000.f);
+	if(avgFPS > 2000000){
+		avgFPS = 0;
+	}
+
+	//Simulated steps per second, measured over the last half second
+	Uint32 ticks = gFPSTimer.getTicks();
+	if(ticks - gRateTicks >= 500){
+		gStepsPerSecond = (frame.step - gRateSteps)*1000.0/(ticks - gRateTicks);
+		gRateSteps = frame.step;
+		gRateTicks = ticks;
+	}
+
+	//Set text to be rendered
+	stringstream timeText;
+	timeText << "Average Frames Per Second " << avgFPS << "  Steps Per Second " << (int)gStepsPerSecond << "  Simulated " << (int)(frame.step*gSettings.dt) << " s  Balls " << frame.drawList.size();
+	if(frame.fastForward){
+		timeText << "  >>";
+	}
+
+	//Render text as black once the font is open, until then the window title carries it
+	if(gFont.get() != NULL){
+		SDL_Color textColor = {0, 0, 0, 255};
+		if(!gFPSTextTexture.loadFromRenderedText(timeText.str().c_str(), textColor)){
+			printf("Unable to render FPS texture!\n");
+		}
+		gFPSTextTexture.render((SCREEN_WIDTH-gFPSTextTexture.getWidth())/2, 0);
+	}
+	else if(gCountedFrames % 30 == 0){
+		SDL_SetWindowTitle(gWindow, ("Bouncing Balls - " + timeText.str()).c_str());
+	}
+	gTelemetry.endPhase(frame.stats, Telemetry::PHASE_OVERLAY);
+
+	//Render the table and then the balls from the draw list
+	gTelemetry.beginPhase(frame.stats, Telemetry::PHASE_RENDER);
+	gTable.render();
+	gTileRenderer.render(frame.drawList, gThreadPool, gBallSprite);
+	gTelemetry.endPhase(frame.stats, Telemetry::PHASE_RENDER);
+
+	//Grab the finished frame before it is presented
+	if(gCapture.isRunning()){
+		gTelemetry.beginPhase(frame.stats, Telemetry::PHASE_CAPTURE);
+		gCapture.captureFrame();
+		gTelemetry.endPhase(frame.stats, Telemetry::PHASE_CAPTURE);
+	}
+
+	//Update screen
+	gTelemetry.beginPhase(frame.stats, Telemetry::PHASE_PRESENT);
+	SDL_RenderPresent(gRenderer);
+	gTelemetry.endPhase(frame.stats, Telemetry::PHASE_PRESENT);
+	++gCountedFrames;
+}
+
+void recordFrame(FrameContext& frame){
+	if(gRecorder.isRunning()){
+		gRecorder.write(frame.step, frame.drawList);
+	}
+}
+
+void flushTelemetry(FrameContext& frame){
+	gTelemetry.record(frame.stats);
+}
+
+FrameScheduler::FrameScheduler(){
+	mStopping = false;
+}
+
+FrameScheduler::~FrameScheduler(){
+	stop();
+}
+
+void FrameScheduler::start(){
+	mStopping = false;
+	mWorker = std::thread(&FrameScheduler::workerLoop, this);
+}
+
+void FrameScheduler::stop(){
+	if(!mWorker.joinable()){
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mStopping = true;
+	}
+	mWorkerReady.notify_one();
+	mWorker.join();
+}
+
+void FrameScheduler::post(Executor executor, std::coroutine_handle<> handle){
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		if(executor == MAIN_THREAD){
+			mMainQueue.push_back(handle);
+		}
+		else{
+			mWorkerQueue.push_back(handle);
+		}
+	}
+	if(executor == MAIN_THREAD){
+		mMainReady.notify_one();
+	}
+	else{
+		mWorkerReady.notify_one();
+	}
+}
+
+void FrameScheduler::runMainOnce(){
+	std::coroutine_handle<> handle;
+	{
+		std::unique_lock<std::mutex> lock(mMutex);
+		mMainReady.wait(lock, [this]{ return !mMainQueue.empty(); });
+		handle = mMainQueue.front();
+		mMainQueue.pop_front();
+	}
+	handle.resume();
+}
+
+FrameScheduler::Switch FrameScheduler::on(Executor executor){
+	Switch hop = { this, executor };
+	return hop;
+}
+
+void FrameScheduler::workerLoop(){
+	while(true){
+		std::coroutine_handle<> handle;
+		{
+			std::unique_lock<std::mutex> lock(mMutex);
+			mWorkerReady.wait(lock, [this]{ return mStopping || !mWorkerQueue.empty(); });
+			if(mWorkerQueue.empty()){
+				return;
+			}
+			handle = mWorkerQueue.front();
+			mWorkerQueue.pop_front();
+		}
+		handle.resume();
+	}
+}
+
+StageEvent::StageEvent(){
+	mSet = false;
+}
+
+void StageEvent::set(){
+	std::vector< std::pair<std::coroutine_handle<>, FrameScheduler::Executor> > waiters;
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mSet = true;
+		waiters.swap(mWaiters);
+	}
+	for(int i = 0; i < waiters.size(); i++){
+		gScheduler.post(waiters[i].second, waiters[i].first);
+	}
+}
+
+StageEvent::Waiter StageEvent::wait(FrameScheduler::Executor executor){
+	Waiter waiter = { this, executor };
+	return waiter;
+}
+
+void StageEvent::Waiter::await_suspend(std::coroutine_handle<> handle){
+	//Already set still hops, so the caller always lands on the thread it asked for
+	{
+		std::lock_guard<std::mutex> lock(event->mMutex);
+		if(!event->mSet){
+			event->mWaiters.push_back(std::make_pair(handle, executor));
+			return;
+		}
+	}
+	gScheduler.post(executor, handle);
+}
+
+FrameTask::FrameTask(std::coroutine_handle<promise_type> handle){
+	mHandle = handle;
+}
+
+FrameTask::FrameTask(FrameTask&& other){
+	mHandle = other.mHandle;
+	other.mHandle = nullptr;
+}
+
+FrameTask::~FrameTask(){
+	if(mHandle){
+		mHandle.destroy();
+	}
+}
+
+void FrameTask::resume(){
+	mHandle.resume();
+}
+
+bool FrameTask::done(){
+	return mHandle.done();
+}
+
+LTexture::LTexture(){
+	//Initialize
+	mTexture = NULL;
+	mWidth = 0;
+	mHeight = 0;
+}
+
+LTexture::~LTexture(){
+	//Deallocate
+	free();
+}
+
+bool LTexture::loadFromPixels(const Uint32* pixels, int width, int height){
+	//Get rid of preexisting texture
+	free();
+
+	mTexture = SDL_CreateTexture(gRenderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STATIC, width, height);
+	if(mTexture == NULL){
+		printf("Unable to create %dx%d texture! SDL Error: %s\n", width, height, SDL_GetError());
+		return false;
+	}
+	SDL_UpdateTexture(mTexture, NULL, pixels, width*sizeof(Uint32));
+	SDL_SetTextureBlendMode(mTexture, SDL_BLENDMODE_BLEND);
+	mWidth = width;
+	mHeight = height;
+	return true;
+}
+
+#ifdef _SDL_TTF_H
+bool LTexture::loadFromRenderedText(std::string textureText, SDL_Color textColor){
+	//Get rid of preexisting texture
+	free();
+
+	//Render text surface
+	SDL_Surface* textSurface = TTF_RenderText_Solid( gFont.get(), textureText.c_str(), textColor );
+	if(textSurface != NULL){
+		//Create texture from surface pixels
+        mTexture = SDL_CreateTextureFromSurface( gRenderer, textSurface );
+		if(mTexture == NULL){
+			printf( "Unable to create texture from rendered text! SDL Error: %s\n", SDL_GetError() );
+		}
+		else{
+			//Get image dimensions
+			mWidth = textSurface->w;
+			mHeight = textSurface->h;
+		}
+
+		//Get rid of old surface
+		SDL_FreeSurface( textSurface );
+	}
+	else{
+		printf( "Unable to render text surface! SDL_ttf Error: %s\n", TTF_GetError() );
+	}
+
+
+	//Return success
+	return mTexture != NULL;
+}
+#endif
+
+void LTexture::free(){
+	//Free texture if it exists
+	if(mTexture != NULL){
+		SDL_DestroyTexture( mTexture );
+		mTexture = NULL;
+		mWidth = 0;
+		mHeight = 0;
+	}
+}
+
+void LTexture::setColor(Uint8 red, Uint8 green, Uint8 blue){
+	//Modulate texture rgb
+	SDL_SetTextureColorMod(mTexture, red, green, blue);
+}
+
+void LTexture::setBlendMode(SDL_BlendMode blending){
+	//Set blending function
+	SDL_SetTextureBlendMode( mTexture, blending );
+}
+
+void LTexture::setAlpha(Uint8 alpha){
+	//Modulate texture alpha
+	SDL_SetTextureAlphaMod( mTexture, alpha );
+}
+
+void LTexture::render(int x, int y, SDL_Rect* clip, double angle, SDL_Point* center, SDL_RendererFlip flip){
+	//Set rendering space and render to screen
+	SDL_Rect renderQuad = { x, y, mWidth, mHeight };
+
+	//Set clip rendering dimensions
+	if( clip != NULL )
+	{
+		renderQuad.w = clip->w;
+		renderQuad.h = clip->h;
+	}
+
+	//Render to screen
+	SDL_RenderCopyEx(gRenderer, mTexture, clip, &renderQuad, angle, center, flip);
+}
+
+int LTexture::getWidth(){
+	return mWidth;
+}
+
+int LTexture::getHeight(){
+	return mHeight;
+}
+
+SDL_Texture* LTexture::getTexture(){
+	return mTexture;
+}
+
+BallSprite::BallSprite(){
+	mLevels = 0;
+}
+
+bool BallSprite::create(int diameter){
+	free();
+	mLevels = 0;
+	for(int size = std::max(1, diameter); mLevels < MAX_LEVELS; size = (size + 1)/2){
+		mSizes[mLevels] = size;
+		drawDisc(size, mPixels[mLevels]);
+		mLevels++;
+		if(size == 1){
+			break;
+		}
+	}
+
+	//Headless runs only use the pixels
+	if(gRenderer == NULL){
+		return true;
+	}
+	for(int level = 0; level < mLevels; level++){
+		if(!mTextures[level].loadFromPixels(&mPixels[level][0], mSizes[level], mSizes[level])){
+			return false;
+		}
+	}
+	return true;
+}
+
+void BallSprite::free(){
+	for(int level = 0; level < mLevels; level++){
+		mTextures[level].free();
+	}
+}
+
+void BallSprite::drawDisc(int size, std::vector<Uint32>& pixels){
+	const int SAMPLES = 4;
+	double radius = size/2.0;
+	pixels.assign(size*size, 0);
+	for(int y = 0; y < size; y++){
+		for(int x = 0; x < size; x++){
+			int covered = 0;
+			for(int sy = 0; sy < SAMPLES; sy++){
+				for(int sx = 0; sx < SAMPLES; sx++){
+					double dx = x + (sx + 0.5)/SAMPLES - radius;
+					double dy = y + (sy + 0.5)/SAMPLES - radius;
+					covered += dx*dx + dy*dy < radius*radius;
+				}
+			}
+			Uint32 alpha = (covered*255 + SAMPLES*SAMPLES/2)/(SAMPLES*SAMPLES);
+			pixels[y*size + x] = alpha << 24;
+		}
+	}
+}
+
+int BallSprite::levelFor(double diameter){
+	for(int level = mLevels - 1; level > 0; level--){
+		if(mSizes[level] >= diameter){
+			return level;
+		}
+	}
+	return 0;
+}
+
+int BallSprite::getLevels(){
+	return mLevels;
+}
+
+int BallSprite::getSize(int level){
+	return mSizes[level];
+}
+
+const Uint32* BallSprite::getPixels(int level){
+	return &mPixels[level][0];
+}
+
+LTexture& BallSprite::getTexture(int level){
+	return mTextures[level];
+}
+
+void BallSprite::setColor(Uint8 red, Uint8 green, Uint8 blue){
+	for(int level = 0; level < mLevels; level++){
+		mTextures[level].setColor(red, green, blue);
+	}
+}
+
+AsyncFont::AsyncFont(){
+	mReady = false;
+	mFont = NULL;
+}
+
+AsyncFont::~AsyncFont(){
+	if(mThread.joinable()){
+		mThread.join();
+	}
+}
+
+void AsyncFont::load(std::string path, int size){
+	close();
+	mThread = std::thread([this, path, size](){
+		if(TTF_WasInit() == 0 && TTF_Init() == -1){
+			printf("SDL_ttf could not initialize! SDL_ttf Error: %s\n", TTF_GetError());
+			return;
+		}
+		TTF_Font* font = TTF_OpenFont(path.c_str(), size);
+		if(font == NULL){
+			printf("Failed to load lazy font! SDL_ttf Error: %s\n", TTF_GetError());
+			return;
+		}
+		mFont = font;
+		mReady.store(true, std::memory_order_release);
+	});
+}
+
+TTF_Font* AsyncFont::get(){
+	return mReady.load(std::memory_order_acquire) ? mFont : NULL;
+}
+
+void AsyncFont::close(){
+	if(mThread.joinable()){
+		mThread.join();
+	}
+	if(mFont != NULL){
+		TTF_CloseFont(mFont);
+		mFont = NULL;
+	}
+	mReady = false;
+}
+#endif
+
+Ball::Ball(double x, double y, double velX, double velY){
+    //Initialize the offsets
+    mPosX = x;
+    mPosY = y;
+
+	//Set collision circle size, the sprite is drawn at the same size
+	mCollider.r = BALL_WIDTH / 2;
+
+    //Initialize the velocity
+    mVelX = velX;
+    mVelY = velY;
+
+	mPocketed = false;
+
+	//Move collider relative to the circle
+	shiftColliders();
+}
+//moves the ball through one substep and bounces it off the cushions, other balls are left to gContacts
+void Ball::move(int currentBall, double h){
+	//Pocketed balls stay where they fell
+	if(mPocketed){
+		return;
+	}
+	gTelemetry.current.substeps++;
+
+	//Velocity Verlet, the only force is the constant pull down the table so the half kicks collapse into one
+	double accelY = gSettings.gravity;
+	mPosX += mVelX*h;
+	mPosY += mVelY*h + 0.5*accelY*h*h;
+	mVelY += accelY*h;
+	shiftColliders();
+	if(accelY != 0 && gMonitor.isEnabled()){
+		gMonitor.addGravityImpulse(BALL_MASS*accelY*h);
+	}
+
+	//Keep the shared collider and the broadphase in step with the ball
+	gColliders.at(currentBall) = mCollider;
+	gGrid.update(currentBall, mPosX, mPosY);
+
+	collide(currentBall);
+}
+
+//One clone per instruction set, picked when the program loads. Every clone does the same operations in the same
+//order without fused multiply-adds, so the result does not depend on which one runs
+__attribute__((target_clones("avx512f", "avx2", "default")))
+int Ball::integrate(Ball* balls, Circle* colliders, int count, double h, bool periodic, double impulse[2], double& pressure){
+	double gravity = gSettings.gravity;
+	double width = gWorldWidth, height = gWorldHeight;
+	//Bounces are summed as doubles, a reduction mixing integer and floating point sums is not vectorised
+	double bounces = 0, impulseX = 0, impulseY = 0, pressureSum = 0;
+	#pragma omp simd reduction(+:bounces, impulseX, impulseY, pressureSum)
+	for(int i = 0; i < count; i++){
+		Ball& ball = balls[i];
+		double r = ball.mCollider.r;
+
+		//Velocity Verlet, the same operations as move
+		double x = ball.mPosX + ball.mVelX*h;
+		double y = ball.mPosY + (ball.mVelY*h + 0.5*gravity*h*h);
+		double velX = ball.mVelX;
+		double velY = ball.mVelY + gravity*h;
+
+		//A periodic table brings balls that left it back across the opposite edge, as TableGeometry::wrap does
+		bool outside = x < 0 || x >= width || y < 0 || y >= height;
+		double wrappedX = x - width*floor(x/width);
+		double wrappedY = y - height*floor(y/height);
+		wrappedX = wrappedX < width ? wrappedX : 0;
+		wrappedY = wrappedY < height ? wrappedY : 0;
+
+		//The box walls as TableGeometry::collide sees them: a ball overlapping a wall is pushed back to touching it,
+		//but only turned around if it is heading into the wall, and the pushes only stick if it bounced
+		bool left = x < r, right = width - x < r, top = y < r, bottom = height - y < r;
+		bool bounceX = !periodic && ((left && velX < 0) || (right && velX > 0));
+		bool bounceY = !periodic && ((top && velY < 0) || (bottom && velY > 0));
+		bool bounced = bounceX || bounceY;
+		double pushedX = left ? x + (r - x) : (right ? x - (r - (width - x)) : x);
+		double pushedY = top ? y + (r - y) : (bottom ? y - (r - (height - y)) : y);
+		double wallX = bounceX ? -2*BALL_MASS*velX : 0;
+		double wallY = bounceY ? -2*BALL_MASS*velY : 0;
+		pressureSum += fabs(wallX) + fabs(wallY);
+		bounces += (bounceX ? 1 : 0) + (bounceY ? 1 : 0);
+		velX = bounceX ? -velX : velX;
+		velY = bounceY ? -velY : velY;
+
+		//Height gained or lost in the push is paid for out of the speed, like setPosition does
+		double speedSq = velX*velX + velY*velY;
+		double scale = sqrt(fmax(0, speedSq + 2*gravity*(pushedY - y))/speedSq);
+		scale = bounced && gravity != 0 && speedSq > 0 ? scale : 1;
+		impulseX += wallX + BALL_MASS*(scale - 1)*velX;
+		impulseY += wallY + BALL_MASS*(scale - 1)*velY;
+
+		x = periodic ? (outside ? wrappedX : x) : (bounced ? pushedX : x);
+		y = periodic ? (outside ? wrappedY : y) : (bounced ? pushedY : y);
+		ball.mPosX = x;
+		ball.mPosY = y;
+		ball.mVelX = velX*scale;
+		ball.mVelY = velY*scale;
+		ball.mCollider.x = x;
+		ball.mCollider.y = y;
+		colliders[i].x = x;
+		colliders[i].y = y;
+	}
+	impulse[0] += impulseX;
+	impulse[1] += impulseY;
+	pressure += pressureSum;
+	return (int)bounces;
+}
+
+void Ball::collide(int currentBall){
+	//A periodic table has no cushions, only edges to wrap across
+	if(gTable.isPeriodic()){
+		if(gTable.wrap(mPosX, mPosY)){
+			shiftColliders();
+			gColliders.at(currentBall) = mCollider;
+			gGrid.update(currentBall, mPosX, mPosY);
+		}
+		return;
+	}
+
+	//Cushions are checked once per move through the table's hierarchy
+	double x = mPosX, y = mPosY;
+	int bounces = gTable.collide(x, y, mVelX, mVelY, mCollider.r);
+	if(bounces > 0){
+		setPosition(x, y);
+		gColliders.at(currentBall) = mCollider;
+		gGrid.update(currentBall, mPosX, mPosY);
+		gTelemetry.current.wallBounces += bounces;
+	}
+
+	//Balls whose center reaches a pocket leave play
+	if(gTable.hasPockets() && gTable.inPocket(mPosX, mPosY)){
+		pocket();
+		gColliders.at(currentBall) = mCollider;
+	}
+}
+
+void Ball::pocket(){
+	if(gMonitor.isEnabled()){
+		double energy = 0.5*Ball::BALL_MASS*(mVelX*mVelX + mVelY*mVelY) + Ball::BALL_MASS*gSettings.gravity*(gWorldHeight - mPosY);
+		gMonitor.addRemoved(energy, Ball::BALL_MASS*mVelX, Ball::BALL_MASS*mVelY);
+	}
+	mPocketed = true;
+	mVelX = 0;
+	mVelY = 0;
+}
+
+bool Ball::isPocketed(){
+	return mPocketed;
+}
+
+//make a return velocity function for
+#ifndef BOUNCING_BALL_LIBRARY
+void Ball::render(){
+    //Show the ball
+	LTexture& texture = gBallSprite.getTexture(gBallSprite.levelFor(2*mCollider.r));
+	SDL_Rect quad = { (int)lround(mPosX - mCollider.r), (int)lround(mPosY - mCollider.r), (int)lround(2*mCollider.r), (int)lround(2*mCollider.r) };
+	SDL_RenderCopy(gRenderer, texture.getTexture(), NULL, &quad);
+}
+#endif
+double Ball::getVelX(){
+    return mVelX;
+}
+double Ball::getVelY(){
+    return mVelY;
+}
+
+void Ball::setPosition(double x, double y){
+	//Without this every push out of a cushion under gravity would leak a little energy in or out
+	if(gSettings.gravity != 0){
+		double speedSq = mVelX*mVelX + mVelY*mVelY;
+		if(speedSq > 0){
+			double scale = sqrt(fmax(0, speedSq + 2*gSettings.gravity*(y - mPosY))/speedSq);
+			gMonitor.addWallImpulse(BALL_MASS*(scale - 1)*mVelX, BALL_MASS*(scale - 1)*mVelY);
+			mVelX *= scale;
+			mVelY *= scale;
+		}
+	}
+	mPosX = x;
+	mPosY = y;
+	shiftColliders();
+}
+
+Circle& Ball::getCollider(){
+	return mCollider;
+}
+
+BallState Ball::getState(){
+	BallState state;
+	state.posX = mPosX;
+	state.posY = mPosY;
+	state.velX = mVelX;
+	state.velY = mVelY;
+	state.r = mCollider.r;
+	state.pocketed = mPocketed;
+	return state;
+}
+
+void Ball::setState(const BallState& state){
+	mPosX = state.posX;
+	mPosY = state.posY;
+	mVelX = state.velX;
+	mVelY = state.velY;
+	mCollider.r = state.r;
+	mPocketed = state.pocketed != 0;
+	shiftColliders();
+}
+
+void Ball::shiftColliders(){
+	//Align collider to center of ball
+	mCollider.x = mPosX;
+	mCollider.y = mPosY;
+}
+
+//bug: Improve on the flexibility of this
+
+void loadBalls(int n){
+	//Table-like layout of initial positions of the balls
+	int columnCount = 1;
+	int rowCount = 1;
+	//Offset for the left and right 'walls'
+	int offset = SCREEN_WIDTH/10;
+	int posY = Ball::BALL_WIDTH;
+	int posX = Ball::BALL_HEIGHT;
+
+	for(int i = 0; i < n; i++){
+		posX = columnCount*(Ball::BALL_WIDTH + offset);
+		columnCount++;
+		if(posX > (SCREEN_WIDTH - offset)){
+			rowCount++;
+			posY = rowCount*(Ball::BALL_HEIGHT + offset);
+			columnCount = 1;
+		}
+		//Any direction, at one to five pixels per frame of a 60 Hz display
+		double angle = 2*PI*(rand()/(RAND_MAX + 1.0));
+		double speed = 60 + 240*(rand()/(RAND_MAX + 1.0));
+		Ball ball(posX-50, posY, speed*cos(angle), speed*sin(angle));
+		spawnBall(ball);
+	}
+}
+
+bool checkCollision(Circle& a, Circle& b){
+	//Calculate total radius
+    double totalRadii = a.r + b.r;
+
+    //If the ditsance between the centers of the circles is less than the sum of their radii
+    if(distance(a.x, a.y, b.x, b.y) < (totalRadii)){
+        //The circles have collided
+        return true;
+    }
+    return false;
+}
+
+double distance(double x1, double y1, double x2, double y2){
+	double deltaX = x2 - x1;
+	double deltaY = y2 - y1;
+	gTable.minimumImage(deltaX, deltaY);
+	return sqrt(deltaX*deltaX + deltaY*deltaY);
+}
+
+bool calculateNewVel(Ball& curBall, Ball& otherBall){
+    //unit normal from the current ball to the other one
+    double dist = distance(curBall.mPosX, curBall.mPosY, otherBall.mPosX, otherBall.mPosY);
+    if(dist == 0){
+        return false;
+    }
+    double deltaX = otherBall.mPosX - curBall.mPosX, deltaY = otherBall.mPosY - curBall.mPosY;
+    gTable.minimumImage(deltaX, deltaY);
+    double normalX = deltaX/dist;
+    double normalY = deltaY/dist;
+
+    //equal masses swap the velocity along the normal and keep the rest, only while the balls close in
+    double approach = (curBall.mVelX - otherBall.mVelX)*normalX + (curBall.mVelY - otherBall.mVelY)*normalY;
+    if(approach <= 0){
+        return false;
+    }
+    curBall.mVelX -= approach*normalX;
+    curBall.mVelY -= approach*normalY;
+    otherBall.mVelX += approach*normalX;
+    otherBall.mVelY += approach*normalY;
+    return true;
+}
+
+int substepsNeeded(int count){
+	double maxStep = gSettings.substepFraction * Ball::BALL_WIDTH / 2;
+	if(maxStep <= 0 || count == 0){
+		return 1;
+	}
+
+	double fastestSq = 0;
+	const Ball* balls = &gBalls[0];
+	#pragma omp simd reduction(max:fastestSq)
+	for(int i = 0; i < count; i++){
+		fastestSq = std::max(fastestSq, balls[i].mVelX*balls[i].mVelX + balls[i].mVelY*balls[i].mVelY);
+	}
+	double travel = sqrt(fastestSq)*gSettings.dt;
+	return std::min(Ball::MAX_SUBSTEPS, std::max(1, (int)ceil(travel / maxStep)));
+}
+
+void moveBalls(int count, double h){
+	//Cushions with pockets and jaws are only reached through the table's hierarchy, one ball at a time
+	if(gTable.hasPockets() || count == 0){
+		for(int i = 0; i < count; i++){
+			gBalls[i].move(i, h);
+		}
+		return;
+	}
+
+	//Integrate and reflect the whole array in one pass, then relink the balls that changed cell
+	double impulse[2] = { 0, 0 };
+	double pressure = 0;
+	int bounces = Ball::integrate(&gBalls[0], &gColliders[0], count, h, gTable.isPeriodic(), impulse, pressure);
+	gTelemetry.current.substeps += count;
+	gTelemetry.current.wallBounces += bounces;
+	gMonitor.addWallImpulse(impulse[0], impulse[1]);
+	gObservables.addWallImpulse(pressure);
+	if(gSettings.gravity != 0 && gMonitor.isEnabled()){
+		gMonitor.addGravityImpulse(count*Ball::BALL_MASS*gSettings.gravity*h);
+	}
+	for(int i = 0; i < count; i++){
+		gGrid.update(i, gColliders[i].x, gColliders[i].y);
+	}
+}
+
+void nudgeBallMath(Circle& curBall, Circle& otherBall){
+    //distance to be moved, each ball takes half the overlap
+    double dist = distance(curBall.x,curBall.y,otherBall.x,otherBall.y);
+    double x = (curBall.r + otherBall.r - dist)/2;
+
+    //balls on the same spot have no line between them, so split them sideways
+    double deltaX = curBall.x - otherBall.x, deltaY = curBall.y - otherBall.y;
+    gTable.minimumImage(deltaX, deltaY);
+    double normalX = dist > 0 ? deltaX/dist : 1;
+    double normalY = dist > 0 ? deltaY/dist : 0;
+
+    curBall.x += normalX*x;
+    curBall.y += normalY*x;
+    otherBall.x -= normalX*x;
+    otherBall.y -= normalY*x;
+}
+void nudgeBallLoop(){
+    //balls that were pushed, written back once the grid is no longer being walked
+    std::vector<int> nudged;
+    for(int i = 0; i<gColliders.size();i++){
+        int currentBall = i;
+        if(gBalls[currentBall].isPocketed()){
+            continue;
+        }
+        //Only balls in the neighbouring grid cells can overlap
+        Circle& ballCircle = gBalls[currentBall].getCollider();
+        gGrid.query(ballCircle.x, ballCircle.y, [currentBall, &nudged](int j){
+            if(j == currentBall || gBalls[j].isPocketed()){
+                return;
+            }
+            gTelemetry.current.narrowTests++;
+            if(checkCollision(gColliders[currentBall], gColliders[j])){
+                gTelemetry.current.nudges++;
+                nudgeBallMath(gColliders[currentBall],gColliders[j]);
+                nudged.push_back(currentBall);
+                nudged.push_back(j);
+            }
+        });
+    }
+
+    for(int i = 0; i < nudged.size(); i++){
+        Circle& circle = gColliders[nudged[i]];
+        gTable.wrap(circle.x, circle.y);
+        gBalls[nudged[i]].setPosition(circle.x, circle.y);
+        gGrid.update(nudged[i], circle.x, circle.y);
+    }
+}
+
+BallHandle spawnBall(const Ball& ball){
+	int index = gBalls.size();
+	gBalls.push_back(ball);
+	gColliders.push_back(gBalls[index].getCollider());
+	gGrid.insert(index, gColliders[index].x, gColliders[index].y);
+	return gRegistry.add(index);
+}
+
+bool despawnBall(BallHandle handle){
+	int index = gRegistry.indexOf(handle);
+	if(index < 0){
+		return false;
+	}
+
+	//Move the last ball into the hole so the arrays stay packed
+	int last = gBalls.size() - 1;
+	gGrid.remove(index);
+	if(index != last){
+		gBalls[index] = gBalls[last];
+		gColliders[index] = gColliders[last];
+		gGrid.rename(last, index);
+	}
+	gBalls.pop_back();
+	gColliders.pop_back();
+	gRegistry.removeAt(index, last);
+	return true;
+}
+
+void clearBalls(){
+	gBalls.clear();
+	gColliders.clear();
+	gRegistry.clear();
+	gGrid.reset(gWorldWidth, gWorldHeight, Ball::BALL_WIDTH/2, gTable.isPeriodic());
+}
+
+void removePocketedBalls(){
+	//Walk backwards so the balls swapped into freed places have already been checked
+	for(int i = gBalls.size() - 1; i >= 0; i--){
+		if(i < gBalls.size() && gBalls[i].isPocketed()){
+			despawnBall(gRegistry.handleAt(i));
+		}
+	}
+}
+
+void BallRegistry::clear(){
+	mSlots.clear();
+	mFreeSlots.clear();
+	mSlotOfIndex.clear();
+}
+
+BallHandle BallRegistry::add(int index){
+	//Reuse a free slot when there is one, its generation was bumped on release
+	Uint32 slot;
+	if(!mFreeSlots.empty()){
+		slot = mFreeSlots.back();
+		mFreeSlots.pop_back();
+	}
+	else{
+		slot = mSlots.size();
+		Slot fresh = { 0, -1 };
+		mSlots.push_back(fresh);
+	}
+	mSlots[slot].index = index;
+	if(index >= mSlotOfIndex.size()){
+		mSlotOfIndex.resize(index + 1);
+	}
+	mSlotOfIndex[index] = slot;
+
+	BallHandle handle = { slot, mSlots[slot].generation };
+	return handle;
+}
+
+void BallRegistry::removeAt(int index, int last){
+	Uint32 slot = mSlotOfIndex[index];
+	mSlots[slot].index = -1;
+	mSlots[slot].generation++;
+	mFreeSlots.push_back(slot);
+
+	//The ball that was last now answers for index
+	if(index != last){
+		Uint32 movedSlot = mSlotOfIndex[last];
+		mSlots[movedSlot].index = index;
+		mSlotOfIndex[index] = movedSlot;
+	}
+	mSlotOfIndex.pop_back();
+}
+
+int BallRegistry::indexOf(BallHandle handle){
+	if(handle.slot >= mSlots.size() || mSlots[handle.slot].generation != handle.generation){
+		return -1;
+	}
+	return mSlots[handle.slot].index;
+}
+
+BallHandle BallRegistry::handleAt(int index){
+	Uint32 slot = mSlotOfIndex[index];
+	BallHandle handle = { slot, mSlots[slot].generation };
+	return handle;
+}
+
+void BallRegistry::permute(const std::vector<int>& order){
+	std::vector<Uint32> slotOfIndex(order.size());
+	for(int i = 0; i < order.size(); i++){
+		slotOfIndex[i] = mSlotOfIndex[order[i]];
+		mSlots[slotOfIndex[i]].index = i;
+	}
+	mSlotOfIndex.swap(slotOfIndex);
+}
+
+SpatialGrid::SpatialGrid(){
+	mCellWidth = 1;
+	mCellHeight = 1;
+	mColumns = 0;
+	mRows = 0;
+	mWrap = false;
+}
+
+void SpatialGrid::reset(double width, double height, double maxRadius, bool wrap){
+	//Cells at least a diameter wide, so touching balls are never more than one cell apart
+	double cellSize = 2*maxRadius > 1 ? 2*maxRadius : 1;
+	mWrap = wrap;
+	mCellWidth = cellSize;
+	mCellHeight = cellSize;
+	mColumns = (int)ceil(width / cellSize);
+	mRows = (int)ceil(height / cellSize);
+
+	//Wrapped, the last cell must end on the edge, so cells are stretched to a whole number across the table
+	if(wrap){
+		mColumns = std::max(1, (int)floor(width / cellSize));
+		mRows = std::max(1, (int)floor(height / cellSize));
+		mCellWidth = width / mColumns;
+		mCellHeight = height / mRows;
+	}
+	if(mColumns < 1){
+		mColumns = 1;
+	}
+	if(mRows < 1){
+		mRows = 1;
+	}
+	mCells.assign(mColumns*mRows, std::vector<int>());
+	mCellOf.clear();
+	mSlotInCell.clear();
+}
+
+int SpatialGrid::columnFor(double x){
+	int column = (int)floor(x / mCellWidth);
+	return column < 0 ? 0 : (column >= mColumns ? mColumns - 1 : column);
+}
+
+int SpatialGrid::rowFor(double y){
+	int row = (int)floor(y / mCellHeight);
+	return row < 0 ? 0 : (row >= mRows ? mRows - 1 : row);
+}
+
+void SpatialGrid::insert(int index, double x, double y){
+	if(index >= mCellOf.size()){
+		mCellOf.resize(index + 1, -1);
+		mSlotInCell.resize(index + 1, -1);
+	}
+	int cell = rowFor(y)*mColumns + columnFor(x);
+	mCellOf[index] = cell;
+	mSlotInCell[index] = mCells[cell].size();
+	mCells[cell].push_back(index);
+}
+
+void SpatialGrid::remove(int index){
+	//Swap-and-pop inside the cell too
+	std::vector<int>& cell = mCells[mCellOf[index]];
+	int slot = mSlotInCell[index];
+	int moved = cell.back();
+	cell[slot] = moved;
+	mSlotInCell[moved] = slot;
+	cell.pop_back();
+	mCellOf[index] = -1;
+}
+
+void SpatialGrid::update(int index, double x, double y){
+	//Most moves stay inside the same cell and cost one lookup
+	int cell = rowFor(y)*mColumns + columnFor(x);
+	if(cell != mCellOf[index]){
+		remove(index);
+		insert(index, x, y);
+	}
+}
+
+int SpatialGrid::cellFor(double x, double y){
+	return rowFor(y)*mColumns + columnFor(x);
+}
+
+void SpatialGrid::permute(const std::vector<int>& order){
+	std::vector<int> cellOf(order.size()), slotInCell(order.size());
+	for(int i = 0; i < order.size(); i++){
+		cellOf[i] = mCellOf[order[i]];
+		slotInCell[i] = mSlotInCell[order[i]];
+		mCells[cellOf[i]][slotInCell[i]] = i;
+	}
+	mCellOf.swap(cellOf);
+	mSlotInCell.swap(slotInCell);
+}
+
+void SpatialGrid::rename(int oldIndex, int newIndex){
+	int cell = mCellOf[oldIndex];
+	int slot = mSlotInCell[oldIndex];
+	mCells[cell][slot] = newIndex;
+	mCellOf[newIndex] = cell;
+	mSlotInCell[newIndex] = slot;
+	mCellOf.pop_back();
+	mSlotInCell.pop_back();
+}
+#ifndef BOUNCING_BALL_LIBRARY
+LTimer::LTimer(){
+    //Initialize the variables
+    mStartTicks = 0;
+    mPausedTicks = 0;
+
+    mPaused = false;
+    mStarted = false;
+}
+
+void LTimer::start(){
+    //Start the timer
+    mStarted = true;
+
+    //Unpause the timer
+    mPaused = false;
+
+    //Get the current clock time
+    mStartTicks = SDL_GetTicks();
+	mPausedTicks = 0;
+}
+
+void LTimer::stop(){
+    //Stop the timer
+    mStarted = false;
+
+    //Unpause the timer
+    mPaused = false;
+
+	//Clear tick variables
+	mStartTicks = 0;
+	mPausedTicks = 0;
+}
+
+Uint32 LTimer::getTicks(){
+	//The actual timer time
+	Uint32 time = 0;
+
+    //If the timer is running
+    if(mStarted){
+        //If the timer is paused
+        if(mPaused){
+            //Return the number of ticks when the timer was paused
+            time = mPausedTicks;
+        }
+        else{
+            //Return the current time minus the start time
+            time = SDL_GetTicks() - mStartTicks;
+        }
+    }
+    return time;
+}
+
+FrameCapture::FrameCapture(){
+	//Initialize
+	mFile = NULL;
+	mWidth = 0;
+	mHeight = 0;
+	mFormat = FORMAT_Y4M;
+	mPolicy = DROP_FRAMES;
+	mHeldBuffer = -1;
+	mRunning.store(false);
+	mCaptured = 0;
+	mDropped = 0;
+	mWritten.store(0);
+	mStallMs = 0;
+}
+
+FrameCapture::~FrameCapture(){
+	stop();
+}
+
+bool FrameCapture::start(std::string path, int width, int height, int fps, Format format, Policy policy, int bufferCount){
+	//Y4M 4:2:0 needs even dimensions
+	if(format == FORMAT_Y4M && (width % 2 != 0 || height % 2 != 0)){
+		printf("Capture size %dx%d must be even for Y4M!\n", width, height);
+		return false;
+	}
+
+	mFile = fopen(path.c_str(), "wb");
+	if(mFile == NULL){
+		printf("Unable to open capture file %s!\n", path.c_str());
+		return false;
+	}
+
+	mPath = path;
+	mWidth = width;
+	mHeight = height;
+	mFormat = format;
+	mPolicy = policy;
+	mCaptured = 0;
+	mDropped = 0;
+	mWritten.store(0);
+	mStallMs = 0;
+
+	if(mFormat == FORMAT_Y4M){
+		fprintf(mFile, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n", mWidth, mHeight, fps);
+		mPlanes.resize(mWidth*mHeight + 2*(mWidth/2)*(mHeight/2));
+	}
+
+	//Allocate the pool up front so capturing never allocates
+	if(bufferCount < 2){
+		bufferCount = 2;
+	}
+	mBuffers.assign(bufferCount, std::vector<Uint8>(mWidth*mHeight*4));
+	mFreeBuffers.reset(bufferCount);
+	mFilledBuffers.reset(bufferCount);
+	for(int i = 0; i < bufferCount; i++){
+		mFreeBuffers.push(i);
+	}
+	mHeldBuffer = -1;
+
+	mRunning.store(true);
+	mWriter = std::thread(&FrameCapture::writerLoop, this);
+	return true;
+}
+
+void FrameCapture::captureFrame(){
+	//Take the buffer a failed read left behind, then a free one, or wait for the writer to return one
+	int buffer = mHeldBuffer;
+	mHeldBuffer = -1;
+	if(buffer < 0 && !mFreeBuffers.pop(buffer)){
+		if(mPolicy == DROP_FRAMES){
+			mDropped++;
+			return;
+		}
+		std::chrono::steady_clock::time_point stallStart = std::chrono::steady_clock::now();
+		while(!mFreeBuffers.pop(buffer)){
+			std::this_thread::yield();
+		}
+		mStallMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - stallStart).count();
+	}
+
+	//Read back the render target as BGRA bytes
+	if(SDL_RenderReadPixels(gRenderer, NULL, SDL_PIXELFORMAT_ARGB8888, &mBuffers[buffer][0], mWidth*4) != 0){
+		printf("Unable to read frame pixels! SDL Error: %s\n", SDL_GetError());
+		mHeldBuffer = buffer;
+		return;
+	}
+
+	//Queue size equals the pool size so this cannot fail
+	mFilledBuffers.push(buffer);
+	mCaptured++;
+}
+
+void FrameCapture::stop(){
+	if(!mRunning.load()){
+		return;
+	}
+
+	//Writer drains whatever is still queued before exiting
+	mRunning.store(false);
+	mWriter.join();
+
+	fclose(mFile);
+	mFile = NULL;
+
+	printf("Frame capture %s: %d captured, %d written, %d dropped, %.1f ms stalled on the writer\n", mPath.c_str(), mCaptured, mWritten.load(), mDropped, mStallMs);
+	if(mFormat == FORMAT_RAW){
+		printf("Raw frames are %dx%d BGRA\n", mWidth, mHeight);
+	}
+
+	mBuffers.clear();
+}
+
+bool FrameCapture::isRunning(){
+	return mRunning.load();
+}
+
+void FrameCapture::writerLoop(){
+	int buffer;
+	while(true){
+		if(mFilledBuffers.pop(buffer)){
+			if(mFormat == FORMAT_Y4M){
+				writeY4MFrame(mBuffers[buffer]);
+			}
+			else{
+				fwrite(&mBuffers[buffer][0], 1, mBuffers[buffer].size(), mFile);
+			}
+			mWritten++;
+
+			//Hand the buffer back to the main loop
+			mFreeBuffers.push(buffer);
+		}
+		else if(!mRunning.load()){
+			//Recheck after the stop flag so no frame is left behind
+			if(mFilledBuffers.empty()){
+				break;
+			}
+		}
+		else{
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+	}
+}
+
+void FrameCapture::writeY4MFrame(const std::vector<Uint8>& pixels){
+	Uint8* yPlane = &mPlanes[0];
+	Uint8* uPlane = yPlane + mWidth*mHeight;
+	Uint8* vPlane = uPlane + (mWidth/2)*(mHeight/2);
+
+	//Full range BT.601 luma
+	for(int i = 0; i < mWidth*mHeight; i++){
+		int b = pixels[i*4], g = pixels[i*4 + 1], r = pixels[i*4 + 2];
+		yPlane[i] = (Uint8)((77*r + 150*g + 29*b + 128) >> 8);
+	}
+
+	//Chroma averaged over each 2x2 block
+	for(int y = 0; y < mHeight/2; y++){
+		for(int x = 0; x < mWidth/2; x++){
+			int r = 0, g = 0, b = 0;
+			for(int dy = 0; dy < 2; dy++){
+				for(int dx = 0; dx < 2; dx++){
+					int i = ((2*y + dy)*mWidth + 2*x + dx)*4;
+					b += pixels[i];
+					g += pixels[i + 1];
+					r += pixels[i + 2];
+				}
+			}
+			r /= 4;
+			g /= 4;
+			b /= 4;
+			uPlane[y*(mWidth/2) + x] = (Uint8)((-43*r - 85*g + 128*b + 128*256 + 128) >> 8);
+			vPlane[y*(mWidth/2) + x] = (Uint8)((128*r - 107*g - 21*b + 128*256 + 128) >> 8);
+		}
+	}
+
+	fputs("FRAME\n", mFile);
+	fwrite(&mPlanes[0], 1, mPlanes.size(), mFile);
+}
+#endif
+
+const SDL_Color RenderSnapshot::PALETTE[RenderSnapshot::PALETTE_SIZE] = {
+	{0xFF, 0xFF, 0xFF, 0xFF},
+	{0xF0, 0xD0, 0x20, 0xFF},
+	{0x20, 0x40, 0xD0, 0xFF},
+	{0xE0, 0x20, 0x20, 0xFF},
+	{0x80, 0x20, 0xA0, 0xFF},
+	{0xF0, 0x80, 0x10, 0xFF},
+	{0x10, 0x90, 0x40, 0xFF},
+	{0x90, 0x20, 0x20, 0xFF}
+};
+
+RenderSnapshot::RenderSnapshot(){
+	mWorldWidth = 1;
+	mWorldHeight = 1;
+	mWrapped = false;
+}
+
+void RenderSnapshot::pack(std::vector<Ball>& balls, BallRegistry& registry, double worldWidth, double worldHeight, bool colored, bool wrapped){
+	mWorldWidth = worldWidth;
+	mWorldHeight = worldHeight;
+	mWrapped = wrapped;
+
+	//Gather the balls in play, the objects are too wide to quantise in place
+	mX.clear();
+	mY.clear();
+	mR.clear();
+	mBalls.clear();
+	for(int i = 0; i < balls.size(); i++){
+		if(balls[i].isPocketed()){
+			continue;
+		}
+		const Circle& circle = balls[i].getCollider();
+		mX.push_back(circle.x);
+		mY.push_back(circle.y);
+		mR.push_back(circle.r);
+
+		//Tints follow the handle slot so a ball keeps its color when others are removed
+		RenderBall ball;
+		ball.color = colored ? 1 + registry.handleAt(i).slot % (PALETTE_SIZE - 1) : 0;
+		mBalls.push_back(ball);
+	}
+
+	//Quantise, clamping balls that have strayed off the world
+	int count = mBalls.size();
+	float scaleX = 65535/worldWidth, scaleY = 65535/worldHeight;
+	const float* x = mX.data();
+	const float* y = mY.data();
+	const float* r = mR.data();
+	RenderBall* out = mBalls.data();
+	#pragma omp simd
+	for(int i = 0; i < count; i++){
+		float qx = std::min(std::max(x[i]*scaleX, 0.f), 65535.f);
+		float qy = std::min(std::max(y[i]*scaleY, 0.f), 65535.f);
+		float qr = std::min(std::max(r[i]*16, 0.f), 65535.f);
+		out[i].x = (Uint16)(qx + 0.5f);
+		out[i].y = (Uint16)(qy + 0.5f);
+		out[i].radius = (Uint16)(qr + 0.5f);
+	}
+}
+
+double RenderSnapshot::toX(const RenderBall& ball) const{
+	return ball.x*mWorldWidth/65535;
+}
+
+double RenderSnapshot::toY(const RenderBall& ball) const{
+	return ball.y*mWorldHeight/65535;
+}
+
+double RenderSnapshot::toRadius(const RenderBall& ball) const{
+	return ball.radius/16.0;
+}
+
+int RenderSnapshot::size() const{
+	return mBalls.size();
+}
+
+const RenderBall& RenderSnapshot::operator[](int index) const{
+	return mBalls[index];
+}
+
+const RenderBall* RenderSnapshot::data() const{
+	return mBalls.data();
+}
+
+double RenderSnapshot::getWorldWidth() const{
+	return mWorldWidth;
+}
+
+double RenderSnapshot::getWorldHeight() const{
+	return mWorldHeight;
+}
+
+bool RenderSnapshot::isWrapped() const{
+	return mWrapped;
+}
+
+SnapshotRecorder::SnapshotRecorder(){
+	mFile = NULL;
+	mRecorded = 0;
+	mBytes = 0;
+}
+
+SnapshotRecorder::~SnapshotRecorder(){
+	stop();
+}
+
+bool SnapshotRecorder::start(std::string path, double worldWidth, double worldHeight){
+	mFile = fopen(path.c_str(), "wb");
+	if(mFile == NULL){
+		printf("Unable to open snapshot file %s! errno: %d\n", path.c_str(), errno);
+		return false;
+	}
+	mPath = path;
+	mRecorded = 0;
+
+	//Magic, then the world bounds the positions are quantised against
+	float bounds[2] = {(float)worldWidth, (float)worldHeight};
+	fwrite("BBSNAP01", 1, 8, mFile);
+	fwrite(bounds, sizeof(bounds), 1, mFile);
+	mBytes = 8 + sizeof(bounds);
+	return true;
+}
+
+void SnapshotRecorder::write(Uint64 step, const RenderSnapshot& snapshot){
+	//Each record is the step, the ball count and the packed balls
+	Uint32 count = snapshot.size();
+	bool ok = fwrite(&step, sizeof(step), 1, mFile) == 1;
+	ok = ok && fwrite(&count, sizeof(count), 1, mFile) == 1;
+	ok = ok && fwrite(snapshot.data(), sizeof(RenderBall), count, mFile) == count;
+	if(!ok){
+		printf("Unable to write snapshot %d! errno: %d\n", mRecorded, errno);
+		stop();
+		return;
+	}
+	mRecorded++;
+	mBytes += sizeof(step) + sizeof(count) + count*sizeof(RenderBall);
+}
+
+void SnapshotRecorder::stop(){
+	if(mFile == NULL){
+		return;
+	}
+	fclose(mFile);
+	mFile = NULL;
+	printf("Recorded %d snapshots (%.1f MB) to %s\n", mRecorded, mBytes/1048576.0, mPath.c_str());
+}
+
+bool SnapshotRecorder::isRunning(){
+	return mFile != NULL;
+}
+
+SharedStateExport::SharedStateExport(){
+	mHeader = NULL;
+	mSize = 0;
+	mPublished = 0;
+	mWorldWidth = 0;
+	mWorldHeight = 0;
+}
+
+SharedStateExport::~SharedStateExport(){
+	stop();
+}
+
+bool SharedStateExport::start(std::string name, int capacity, double worldWidth, double worldHeight){
+	mName = name;
+	mPublished = 0;
+	mWorldWidth = worldWidth;
+	mWorldHeight = worldHeight;
+
+	//A segment left behind by a run that crashed is replaced
+	shm_unlink(mName.c_str());
+	if(!create(capacity)){
+		return false;
+	}
+	printf("Publishing the state in shared memory %s\n", mName.c_str());
+	return true;
+}
+
+bool SharedStateExport::create(int capacity){
+	//Readers holding the old segment see it retired and map the new one, which gets the name first
+	if(mHeader != NULL){
+		shm_unlink(mName.c_str());
+	}
+	int fd = shm_open(mName.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+	if(fd < 0){
+		printf("Unable to create shared memory %s! errno: %d\n", mName.c_str(), errno);
+		return false;
+	}
+	size_t size = sharedStateSize(capacity);
+	if(ftruncate(fd, size) != 0){
+		printf("Unable to size shared memory %s! errno: %d\n", mName.c_str(), errno);
+		::close(fd);
+		shm_unlink(mName.c_str());
+		return false;
+	}
+	void* memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	::close(fd);
+	if(memory == MAP_FAILED){
+		printf("Unable to map shared memory %s! errno: %d\n", mName.c_str(), errno);
+		shm_unlink(mName.c_str());
+		return false;
+	}
+
+	//ftruncate zero fills, so both sequences and the published count start at 0
+	SharedStateHeader* header = (SharedStateHeader*)memory;
+	header->magic = SHARED_STATE_MAGIC;
+	header->version = SHARED_STATE_VERSION;
+	header->capacity = capacity;
+	header->worldWidth = mWorldWidth;
+	header->worldHeight = mWorldHeight;
+
+	if(mHeader != NULL){
+		mHeader->retired.store(1, std::memory_order_release);
+		munmap(mHeader, mSize);
+	}
+	mHeader = header;
+	mSize = size;
+	return true;
+}
+
+void SharedStateExport::publish(Uint64 step, double time){
+	int count = gBalls.size();
+	if(count > mHeader->capacity){
+		int capacity = mHeader->capacity;
+		while(capacity < count){
+			capacity *= 2;
+		}
+		if(!create(capacity)){
+			stop();
+			return;
+		}
+	}
+
+	//Write the buffer that does not hold the latest step, odd sequence while it is being filled
+	Uint64 published = mHeader->published.load(std::memory_order_relaxed);
+	SharedBuffer* buffer = sharedBuffer(mHeader, published % 2);
+	Uint64 sequence = buffer->sequence.load(std::memory_order_relaxed);
+	buffer->sequence.store(sequence + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	buffer->step = step;
+	buffer->time = time;
+	buffer->count = count;
+	SharedBall* balls = sharedBalls(buffer);
+	for(int i = 0; i < count; i++){
+		const Ball& ball = gBalls[i];
+		balls[i].x = ball.mPosX;
+		balls[i].y = ball.mPosY;
+		balls[i].velX = ball.mVelX;
+		balls[i].velY = ball.mVelY;
+	}
+
+	buffer->sequence.store(sequence + 2, std::memory_order_release);
+	mHeader->published.store(published + 1, std::memory_order_release);
+	mPublished++;
+}
+
+void SharedStateExport::stop(){
+	if(mHeader == NULL){
+		return;
+	}
+	mHeader->retired.store(1, std::memory_order_release);
+	munmap(mHeader, mSize);
+	mHeader = NULL;
+	shm_unlink(mName.c_str());
+	printf("Published %llu steps to %s\n", (unsigned long long)mPublished, mName.c_str());
+}
+
+bool SharedStateExport::isRunning(){
+	return mHeader != NULL;
+}
+
+NumaTopology::NumaTopology(){
+	mBindFailed = false;
+}
+
+void NumaTopology::discover(){
+	mNodeIds.clear();
+	mCpus.clear();
+	mNodeOfCpu.clear();
+	mPlaced.clear();
+
+	char text[4096];
+	FILE* file = fopen("/sys/devices/system/node/online", "r");
+	if(file != NULL){
+		if(fgets(text, sizeof(text), file) != NULL){
+			mNodeIds = parseList(text);
+		}
+		fclose(file);
+	}
+	for(int i = 0; i < mNodeIds.size() && mCpus.size() < MAX_NODES; i++){
+		char path[128];
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", mNodeIds[i]);
+		file = fopen(path, "r");
+		std::vector<int> cpus;
+		if(file != NULL){
+			if(fgets(text, sizeof(text), file) != NULL){
+				cpus = parseList(text);
+			}
+			fclose(file);
+		}
+		mCpus.push_back(cpus);
+	}
+	mNodeIds.resize(mCpus.size());
+
+	//Without sysfs, or with nodes that have no CPUs listed, everything is one node
+	bool usable = !mCpus.empty();
+	for(int node = 0; node < mCpus.size(); node++){
+		usable = usable && !mCpus[node].empty();
+	}
+	if(!usable){
+		mNodeIds.assign(1, 0);
+		mCpus.assign(1, std::vector<int>());
+		for(int cpu = 0; cpu < (int)std::thread::hardware_concurrency(); cpu++){
+			mCpus[0].push_back(cpu);
+		}
+	}
+
+	for(int node = 0; node < mCpus.size(); node++){
+		for(int i = 0; i < mCpus[node].size(); i++){
+			int cpu = mCpus[node][i];
+			if(cpu >= mNodeOfCpu.size()){
+				mNodeOfCpu.resize(cpu + 1, 0);
+			}
+			mNodeOfCpu[cpu] = node;
+		}
+	}
+	printf("NUMA: %d node%s", (int)mCpus.size(), mCpus.size() == 1 ? "" : "s");
+	for(int node = 0; node < mCpus.size(); node++){
+		printf("%s node %d has %d CPUs", node == 0 ? "," : ";", mNodeIds[node], (int)mCpus[node].size());
+	}
+	printf("\n");
+}
+
+std::vector<int> NumaTopology::parseList(const std::string& text){
+	std::vector<int> values;
+	std::stringstream stream(text);
+	std::string range;
+	while(std::getline(stream, range, ',')){
+		int first, last;
+		int fields = sscanf(range.c_str(), "%d-%d", &first, &last);
+		if(fields == 1){
+			last = first;
+		}
+		else if(fields != 2){
+			continue;
+		}
+		for(int value = first; value <= last; value++){
+			values.push_back(value);
+		}
+	}
+	return values;
+}
+
+int NumaTopology::getNodeCount(){
+	return mCpus.size();
+}
+
+int NumaTopology::currentNode(){
+	int cpu = sched_getcpu();
+	return cpu >= 0 && cpu < mNodeOfCpu.size() ? mNodeOfCpu[cpu] : 0;
+}
+
+bool NumaTopology::pinThread(pthread_t thread, int node){
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for(int i = 0; i < mCpus[node].size(); i++){
+		CPU_SET(mCpus[node][i], &set);
+	}
+	int error = pthread_setaffinity_np(thread, sizeof(set), &set);
+	if(error != 0){
+		printf("Unable to pin a helper thread to NUMA node %d! error: %d\n", mNodeIds[node], error);
+		return false;
+	}
+	return true;
+}
+
+void NumaTopology::place(const void* data, size_t bytes){
+	//One node has nothing to place, and a failed bind is not retried every step
+	int nodes = mCpus.size();
+	if(nodes <= 1 || data == NULL || bytes == 0 || mBindFailed){
+		return;
+	}
+	for(int i = 0; i < mPlaced.size(); i++){
+		if(mPlaced[i].first == data && mPlaced[i].second == bytes){
+			return;
+		}
+	}
+	mPlaced.push_back(std::make_pair(data, bytes));
+	if(mPlaced.size() > 4){
+		mPlaced.pop_front();
+	}
+
+	//mbind works on whole pages, a page shared by two shares goes to the node whose share starts in it
+	const unsigned long MPOL_BIND_MODE = 2;
+	const unsigned long MPOL_MF_MOVE_FLAG = 1 << 1;
+	uintptr_t page = sysconf(_SC_PAGESIZE);
+	uintptr_t begin = (uintptr_t)data, end = begin + bytes;
+	for(int node = 0; node < nodes; node++){
+		uintptr_t first = node == 0 ? begin/page*page : (begin + bytes*node/nodes + page - 1)/page*page;
+		uintptr_t last = node + 1 == nodes ? (end + page - 1)/page*page : (begin + bytes*(node + 1)/nodes + page - 1)/page*page;
+		if(last <= first){
+			continue;
+		}
+		unsigned long mask[2] = {0, 0};
+		mask[mNodeIds[node]/64] |= 1UL << (mNodeIds[node] % 64);
+		if(syscall(SYS_mbind, first, last - first, MPOL_BIND_MODE, mask, 129, MPOL_MF_MOVE_FLAG) != 0){
+			printf("Unable to bind ball memory to NUMA node %d! errno: %d, keeping the flat layout\n", mNodeIds[node], errno);
+			mBindFailed = true;
+			return;
+		}
+	}
+}
+
+ThreadPool::ThreadPool(){
+	mTask = NULL;
+	mCount = 0;
+	mNext = 0;
+	mTopology = NULL;
+	mNodes = 0;
+	mGeneration = 0;
+	mBusy = 0;
+	mStopping = false;
+}
+
+ThreadPool::~ThreadPool(){
+	stop();
+}
+
+void ThreadPool::start(int threads, NumaTopology* topology){
+	mStopping = false;
+	mTopology = topology != NULL && topology->getNodeCount() > 1 ? topology : NULL;
+
+	//A restarted pool has loops behind it already. Helpers are told the current one here, a helper reading it once
+	//running could miss the first loop the caller starts before it gets going
+	Uint64 generation;
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		generation = mGeneration;
+	}
+	for(int i = 0; i < threads; i++){
+		mThreads.push_back(std::thread(&ThreadPool::workerLoop, this, generation));
+		if(topology != NULL){
+			topology->pinThread(mThreads.back().native_handle(), i*topology->getNodeCount()/threads);
+		}
+	}
+}
+
+void ThreadPool::stop(){
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mStopping = true;
+	}
+	mWake.notify_all();
+	for(int i = 0; i < mThreads.size(); i++){
+		mThreads[i].join();
+	}
+	mThreads.clear();
+}
+
+int ThreadPool::getConcurrency(){
+	return mThreads.size() + 1;
+}
+
+void ThreadPool::parallelFor(int count, const std::function<void(int)>& task){
+	//Small loops and an empty pool are not worth waking anyone for
+	if(count <= 1 || mThreads.empty()){
+		for(int i = 0; i < count; i++){
+			task(i);
+		}
+		return;
+	}
+
+	//One loop at a time, a second caller would overwrite the task the helpers are still running
+	std::lock_guard<std::mutex> callerLock(mCallerMutex);
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mTask = &task;
+		mCount = count;
+		mNext = 0;
+		mNodes = mTopology != NULL ? std::min(mTopology->getNodeCount(), (int)NumaTopology::MAX_NODES) : 0;
+		for(int node = 0; node < mNodes; node++){
+			mNodeNext[node] = (long long)count*node/mNodes;
+			mNodeEnd[node] = (long long)count*(node + 1)/mNodes;
+		}
+		mBusy = mThreads.size();
+		mGeneration++;
+	}
+	mWake.notify_all();
+
+	//The caller takes a share and then waits for the helpers to run dry
+	runTasks();
+	std::unique_lock<std::mutex> lock(mMutex);
+	mFinished.wait(lock, [this]{ return mBusy == 0; });
+	mTask = NULL;
+}
+
+void ThreadPool::runTasks(){
+	if(mNodes == 0){
+		while(true){
+			int i = mNext.fetch_add(1);
+			if(i >= mCount){
+				return;
+			}
+			(*mTask)(i);
+		}
+	}
+
+	//Own node's share first, then whatever the other nodes have left
+	int home = mTopology->currentNode();
+	for(int k = 0; k < mNodes; k++){
+		int node = (home + k) % mNodes;
+		while(true){
+			int i = mNodeNext[node].fetch_add(1);
+			if(i >= mNodeEnd[node]){
+				break;
+			}
+			(*mTask)(i);
+		}
+	}
+}
+
+void ThreadPool::workerLoop(Uint64 seen){
+	while(true){
+		{
+			std::unique_lock<std::mutex> lock(mMutex);
+			mWake.wait(lock, [this, seen]{ return mStopping || mGeneration != seen; });
+			if(mStopping){
+				return;
+			}
+			seen = mGeneration;
+		}
+		runTasks();
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			mBusy--;
+		}
+		mFinished.notify_one();
+	}
+}
+
+#ifndef BOUNCING_BALL_LIBRARY
+TileRenderer::TileRenderer(){
+	mBackend = BACKEND_SPRITES;
+	mWidth = 0;
+	mHeight = 0;
+	mColumns = 0;
+	mRows = 0;
+	mChunks = 0;
+	mFrameTexture = NULL;
+}
+
+TileRenderer::~TileRenderer(){
+	free();
+}
+
+bool TileRenderer::start(Backend backend, int width, int height){
+	free();
+	mBackend = backend;
+	mWidth = width;
+	mHeight = height;
+	mColumns = (width + TILE_SIZE - 1)/TILE_SIZE;
+	mRows = (height + TILE_SIZE - 1)/TILE_SIZE;
+	mTileStart.assign(mColumns*mRows + 1, 0);
+	mVertices.assign(mColumns*mRows, std::vector<SDL_Vertex>());
+	mIndices.assign(mColumns*mRows, std::vector<int>());
+	mTileLevel.assign(mColumns*mRows, 0);
+	if(mBackend != BACKEND_SOFTWARE){
+		return true;
+	}
+
+	//Finished tiles are uploaded into one streaming texture laid over the table, headless runs only fill the pixels
+	mPixels.assign(width*height, 0);
+	if(gRenderer == NULL){
+		return true;
+	}
+	mFrameTexture = SDL_CreateTexture(gRenderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, width, height);
+	if(mFrameTexture == NULL){
+		printf("Unable to create software frame texture! SDL Error: %s\n", SDL_GetError());
+		return false;
+	}
+	SDL_SetTextureBlendMode(mFrameTexture, SDL_BLENDMODE_BLEND);
+	return true;
+}
+
+void TileRenderer::free(){
+	if(mFrameTexture != NULL){
+		SDL_DestroyTexture(mFrameTexture);
+		mFrameTexture = NULL;
+	}
+}
+
+TileRenderer::Backend TileRenderer::getBackend(){
+	return mBackend;
+}
+
+const Uint32* TileRenderer::getPixels(){
+	return mPixels.data();
+}
+
+void TileRenderer::render(const RenderSnapshot& snapshot, ThreadPool& pool, BallSprite& sprite){
+	//The original path, one texture copy per ball from this thread
+	if(mBackend == BACKEND_SPRITES){
+		int tint = 0;
+		for(int i = 0; i < snapshot.size(); i++){
+			const RenderBall& ball = snapshot[i];
+			if(ball.color != tint){
+				tint = ball.color;
+				sprite.setColor(RenderSnapshot::PALETTE[tint].r, RenderSnapshot::PALETTE[tint].g, RenderSnapshot::PALETTE[tint].b);
+			}
+			double r = snapshot.toRadius(ball);
+			SDL_Texture* texture = sprite.getTexture(sprite.levelFor(2*r)).getTexture();
+			int codes[4];
+			int copies = images(snapshot, ball, codes);
+			for(int k = 0; k < copies; k++){
+				SDL_Rect quad = { (int)lround(imageX(snapshot, ball, codes[k]) - r), (int)lround(imageY(snapshot, ball, codes[k]) - r), (int)lround(2*r), (int)lround(2*r) };
+				SDL_RenderCopy(gRenderer, texture, NULL, &quad);
+			}
+		}
+		if(tint != 0){
+			sprite.setColor(0xFF, 0xFF, 0xFF);
+		}
+		return;
+	}
+
+	bin(snapshot, pool);
+
+	if(mBackend == BACKEND_GEOMETRY){
+		//Workers build the vertex lists, only the draw calls need the renderer's thread
+		pool.parallelFor(mColumns*mRows, [&](int tile){ buildGeometry(snapshot, sprite, tile); });
+		for(int tile = 0; tile < mColumns*mRows; tile++){
+			if(!mIndices[tile].empty()){
+				SDL_RenderGeometry(gRenderer, sprite.getTexture(mTileLevel[tile]).getTexture(), mVertices[tile].data(), mVertices[tile].size(), mIndices[tile].data(), mIndices[tile].size());
+			}
+		}
+	}
+	else{
+		//Tiles own disjoint pixels, so workers write the frame without locking
+		pool.parallelFor(mColumns*mRows, [&](int tile){ rasterise(snapshot, sprite, tile); });
+		if(mFrameTexture != NULL){
+			SDL_UpdateTexture(mFrameTexture, NULL, mPixels.data(), mWidth*sizeof(Uint32));
+			SDL_RenderCopy(gRenderer, mFrameTexture, NULL, NULL);
+		}
+	}
+}
+
+int TileRenderer::images(const RenderSnapshot& snapshot, const RenderBall& ball, int codes[4]){
+	codes[0] = 4;
+	if(!snapshot.isWrapped()){
+		return 1;
+	}
+	double x = snapshot.toX(ball), y = snapshot.toY(ball), r = snapshot.toRadius(ball);
+	int shiftX = x - r < 0 ? 1 : (x + r > snapshot.getWorldWidth() ? -1 : 0);
+	int shiftY = y - r < 0 ? 1 : (y + r > snapshot.getWorldHeight() ? -1 : 0);
+	int copies = 1;
+	if(shiftX != 0){
+		codes[copies++] = 4 + shiftX;
+	}
+	if(shiftY != 0){
+		codes[copies++] = 4 + 3*shiftY;
+	}
+	if(shiftX != 0 && shiftY != 0){
+		codes[copies++] = 4 + shiftX + 3*shiftY;
+	}
+	return copies;
+}
+
+double TileRenderer::imageX(const RenderSnapshot& snapshot, const RenderBall& ball, int code){
+	return snapshot.toX(ball) + (code % 3 - 1)*snapshot.getWorldWidth();
+}
+
+double TileRenderer::imageY(const RenderSnapshot& snapshot, const RenderBall& ball, int code){
+	return snapshot.toY(ball) + (code/3 - 1)*snapshot.getWorldHeight();
+}
+
+void TileRenderer::tileRange(const RenderSnapshot& snapshot, const RenderBall& ball, int code, int& column0, int& row0, int& column1, int& row1){
+	double x = imageX(snapshot, ball, code), y = imageY(snapshot, ball, code);
+	double r = mBackend == BACKEND_SOFTWARE ? snapshot.toRadius(ball) : 0;
+	column0 = std::max(0, std::min(mColumns - 1, (int)((x - r)/TILE_SIZE)));
+	column1 = std::max(0, std::min(mColumns - 1, (int)((x + r)/TILE_SIZE)));
+	row0 = std::max(0, std::min(mRows - 1, (int)((y - r)/TILE_SIZE)));
+	row1 = std::max(0, std::min(mRows - 1, (int)((y + r)/TILE_SIZE)));
+}
+
+void TileRenderer::bin(const RenderSnapshot& snapshot, ThreadPool& pool){
+	//A few chunks per thread evens out uneven tiles, but small scenes stay in one
+	int tiles = mColumns*mRows;
+	int count = snapshot.size();
+	mChunks = std::max(1, std::min(pool.getConcurrency()*4, count/1024));
+	mChunkCounts.assign(mChunks*tiles, 0);
+	int chunkSize = (count + mChunks - 1)/mChunks;
+
+	//Count each chunk's balls per tile
+	pool.parallelFor(mChunks, [&](int chunk){
+		int* counts = &mChunkCounts[chunk*tiles];
+		int end = std::min(count, (chunk + 1)*chunkSize);
+		for(int i = chunk*chunkSize; i < end; i++){
+			int codes[4];
+			int copies = images(snapshot, snapshot[i], codes);
+			for(int k = 0; k < copies; k++){
+				int column0, row0, column1, row1;
+				tileRange(snapshot, snapshot[i], codes[k], column0, row0, column1, row1);
+				for(int row = row0; row <= row1; row++){
+					for(int column = column0; column <= column1; column++){
+						counts[row*mColumns + column]++;
+					}
+				}
+			}
+		}
+	});
+
+	//Prefix sum tile-major, so each tile keeps its balls in snapshot order
+	int total = 0;
+	for(int tile = 0; tile < tiles; tile++){
+		mTileStart[tile] = total;
+		for(int chunk = 0; chunk < mChunks; chunk++){
+			int n = mChunkCounts[chunk*tiles + tile];
+			mChunkCounts[chunk*tiles + tile] = total;
+			total += n;
+		}
+	}
+	mTileStart[tiles] = total;
+	mTileBalls.resize(total);
+
+	//Scatter through the per-chunk cursors
+	pool.parallelFor(mChunks, [&](int chunk){
+		int* cursors = &mChunkCounts[chunk*tiles];
+		int end = std::min(count, (chunk + 1)*chunkSize);
+		for(int i = chunk*chunkSize; i < end; i++){
+			int codes[4];
+			int copies = images(snapshot, snapshot[i], codes);
+			for(int k = 0; k < copies; k++){
+				int column0, row0, column1, row1;
+				tileRange(snapshot, snapshot[i], codes[k], column0, row0, column1, row1);
+				for(int row = row0; row <= row1; row++){
+					for(int column = column0; column <= column1; column++){
+						mTileBalls[cursors[row*mColumns + column]++] = 9*i + codes[k];
+					}
+				}
+			}
+		}
+	});
+}
+
+void TileRenderer::buildGeometry(const RenderSnapshot& snapshot, BallSprite& sprite, int tile){
+	std::vector<SDL_Vertex>& vertices = mVertices[tile];
+	std::vector<int>& indices = mIndices[tile];
+	vertices.clear();
+	indices.clear();
+
+	//A tile is one draw call with one texture, the level that suits its largest ball
+	double largest = 0;
+	for(int b = mTileStart[tile]; b < mTileStart[tile + 1]; b++){
+		largest = std::max(largest, snapshot.toRadius(snapshot[mTileBalls[b]/9]));
+	}
+	mTileLevel[tile] = sprite.levelFor(2*largest);
+
+	//One textured quad per ball, tinted through the vertex color
+	for(int b = mTileStart[tile]; b < mTileStart[tile + 1]; b++){
+		const RenderBall& ball = snapshot[mTileBalls[b]/9];
+		int code = mTileBalls[b] % 9;
+		float r = snapshot.toRadius(ball);
+		float left = lround(imageX(snapshot, ball, code) - r), top = lround(imageY(snapshot, ball, code) - r);
+		SDL_Color color = RenderSnapshot::PALETTE[ball.color];
+
+		int first = vertices.size();
+		for(int corner = 0; corner < 4; corner++){
+			SDL_Vertex vertex;
+			float u = corner & 1, v = corner >> 1;
+			vertex.position.x = left + 2*r*u;
+			vertex.position.y = top + 2*r*v;
+			vertex.color = color;
+			vertex.tex_coord.x = u;
+			vertex.tex_coord.y = v;
+			vertices.push_back(vertex);
+		}
+		int quad[6] = {0, 1, 2, 2, 1, 3};
+		for(int k = 0; k < 6; k++){
+			indices.push_back(first + quad[k]);
+		}
+	}
+}
+
+void TileRenderer::rasterise(const RenderSnapshot& snapshot, BallSprite& sprite, int tile){
+	int tileX = (tile % mColumns)*TILE_SIZE, tileY = (tile/mColumns)*TILE_SIZE;
+	int tileRight = std::min(tileX + TILE_SIZE, mWidth), tileBottom = std::min(tileY + TILE_SIZE, mHeight);
+
+	//Clear to transparent so the table shows through
+	for(int y = tileY; y < tileBottom; y++){
+		std::fill(&mPixels[y*mWidth + tileX], &mPixels[y*mWidth + tileRight], 0);
+	}
+
+	//Stamp the sprite, scaled to the ball's size and clipped to the tile
+	for(int b = mTileStart[tile]; b < mTileStart[tile + 1]; b++){
+		const RenderBall& ball = snapshot[mTileBalls[b]/9];
+		int code = mTileBalls[b] % 9;
+		double r = snapshot.toRadius(ball);
+		int left = lround(imageX(snapshot, ball, code) - r), top = lround(imageY(snapshot, ball, code) - r);
+		int size = std::max(1L, lround(2*r));
+		SDL_Color color = RenderSnapshot::PALETTE[ball.color];
+		int level = sprite.levelFor(size);
+		int spriteSize = sprite.getSize(level);
+		const Uint32* pixels = sprite.getPixels(level);
+
+		int x0 = std::max(left, tileX), x1 = std::min(left + size, tileRight);
+		int y0 = std::max(top, tileY), y1 = std::min(top + size, tileBottom);
+		for(int y = y0; y < y1; y++){
+			const Uint32* spriteRow = &pixels[((y - top)*spriteSize/size)*spriteSize];
+			Uint32* out = &mPixels[y*mWidth];
+			for(int x = x0; x < x1; x++){
+				Uint32 pixel = spriteRow[(x - left)*spriteSize/size];
+				Uint32 alpha = pixel >> 24;
+				if(alpha == 0){
+					continue;
+				}
+				Uint32 red = ((pixel >> 16) & 0xFF)*color.r/255;
+				Uint32 green = ((pixel >> 8) & 0xFF)*color.g/255;
+				Uint32 blue = (pixel & 0xFF)*color.b/255;
+				if(alpha < 255){
+					//Anti-aliased edge, straight alpha over whatever the tile already holds
+					Uint32 under = out[x];
+					Uint32 underAlpha = (under >> 24)*(255 - alpha)/255;
+					Uint32 total = alpha + underAlpha;
+					red = (red*alpha + ((under >> 16) & 0xFF)*underAlpha)/total;
+					green = (green*alpha + ((under >> 8) & 0xFF)*underAlpha)/total;
+					blue = (blue*alpha + (under & 0xFF)*underAlpha)/total;
+					alpha = total;
+				}
+				out[x] = (alpha << 24) | (red << 16) | (green << 8) | blue;
+			}
+		}
+	}
+}
+#endif
+
+PerfCounters::PerfCounters(){
+	for(int i = 0; i < COUNTER_TOTAL; i++){
+		mFds[i] = -1;
+	}
+}
+
+PerfCounters::~PerfCounters(){
+	close();
+}
+
+bool PerfCounters::open(){
+	static const Uint64 CONFIGS[COUNTER_TOTAL] = { PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES };
+
+	bool any = false;
+	for(int i = 0; i < COUNTER_TOTAL; i++){
+		//User space only so the default perf_event_paranoid setting allows it, inherited by later threads
+		perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = CONFIGS[i];
+		attr.disabled = 1;
+		attr.inherit = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		mFds[i] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+		if(mFds[i] >= 0){
+			any = true;
+		}
+	}
+	return any;
+}
+
+void PerfCounters::close(){
+	for(int i = 0; i < COUNTER_TOTAL; i++){
+		if(mFds[i] >= 0){
+			::close(mFds[i]);
+			mFds[i] = -1;
+		}
+	}
+}
+
+void PerfCounters::start(){
+	for(int i = 0; i < COUNTER_TOTAL; i++){
+		if(mFds[i] >= 0){
+			ioctl(mFds[i], PERF_EVENT_IOC_RESET, 0);
+			ioctl(mFds[i], PERF_EVENT_IOC_ENABLE, 0);
+		}
+	}
+}
+
+void PerfCounters::stop(){
+	for(int i = 0; i < COUNTER_TOTAL; i++){
+		if(mFds[i] >= 0){
+			ioctl(mFds[i], PERF_EVENT_IOC_DISABLE, 0);
+		}
+	}
+}
+
+long long PerfCounters::read(Counter counter){
+	long long value;
+	if(mFds[counter] < 0 || ::read(mFds[counter], &value, sizeof(value)) != sizeof(value)){
+		return -1;
+	}
+	return value;
+}
+
+SpatialReorder::SpatialReorder(){
+	mInterval = 0;
+	mKey = KEY_CELLS;
+	mReorders = 0;
+	mStepsSinceReorder = 0;
+	mCountersTried = false;
+	mCountersOpen = false;
+	mReorderUs = 0;
+	mCost = 0;
+	mBaseline = 0;
+	mExcessUs = 0;
+	mLastStepUs = 0;
+}
+
+void SpatialReorder::start(int interval, Key key){
+	mInterval = interval;
+	mKey = key;
+	mReorders = 0;
+	mStepsSinceReorder = 0;
+	mReorderUs = 0;
+	mCost = 0;
+	mBaseline = 0;
+	mExcessUs = 0;
+	mLastStepUs = 0;
+}
+
+int SpatialReorder::getReorders(){
+	return mReorders;
+}
+
+void SpatialReorder::beginStep(ThreadPool& pool){
+	if(mInterval < 0){
+		return;
+	}
+
+	//Counters belong to the thread that opens them, so open them from the stepping thread
+	if(mInterval == 0 && !mCountersTried){
+		mCountersTried = true;
+		mCountersOpen = mCounters.open();
+	}
+
+	//Tuned: reorder once the extra cost paid since the last reorder would have bought another one,
+	//guessing a reorder costs about a step until one has been timed
+	double reorderUs = mReorderUs > 0 ? mReorderUs : mLastStepUs;
+	bool due = mInterval > 0 ? mStepsSinceReorder >= mInterval : (mStepsSinceReorder >= 1000 || (mStepsSinceReorder >= 8 && mExcessUs > reorderUs));
+	if(due && gBalls.size() > 1){
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		reorder(pool);
+		mReorderUs = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+		mStepsSinceReorder = 0;
+		mCost = 0;
+		mBaseline = 0;
+		mExcessUs = 0;
+	}
+
+	if(mCountersOpen){
+		mCounters.start();
+	}
+	mStepStart = std::chrono::steady_clock::now();
+}
+
+void SpatialReorder::endStep(){
+	if(mInterval < 0){
+		return;
+	}
+	mStepsSinceReorder++;
+	if(mInterval > 0 || gBalls.empty()){
+		return;
+	}
+	double stepUs = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - mStepStart).count();
+
+	//Misses per ball when they can be counted, time per ball when not
+	double cost = stepUs/gBalls.size();
+	if(mCountersOpen){
+		mCounters.stop();
+		long long misses = mCounters.read(PerfCounters::CACHE_MISSES);
+		if(misses >= 0){
+			cost = (double)misses/gBalls.size();
+		}
+	}
+
+	//Smoothed so one noisy step does not trigger a reorder
+	mCost = mCost > 0 ? 0.75*mCost + 0.25*cost : cost;
+	mLastStepUs = stepUs;
+
+	//The share of the step above the best rate seen since the reorder is charged to lost locality
+	if(mBaseline <= 0 || mCost < mBaseline){
+		mBaseline = mCost;
+	}
+	if(mCost > 0){
+		mExcessUs += stepUs*(1 - mBaseline/mCost);
+	}
+}
+
+Uint32 SpatialReorder::mortonKey(double x, double y, double width, double height){
+	Uint32 qx = (Uint32)std::min(std::max(x/width*65535, 0.0), 65535.0);
+	Uint32 qy = (Uint32)std::min(std::max(y/height*65535, 0.0), 65535.0);
+
+	//Spread the 16 bits of each coordinate into every other bit
+	qx = (qx | (qx << 8)) & 0x00FF00FF;
+	qx = (qx | (qx << 4)) & 0x0F0F0F0F;
+	qx = (qx | (qx << 2)) & 0x33333333;
+	qx = (qx | (qx << 1)) & 0x55555555;
+	qy = (qy | (qy << 8)) & 0x00FF00FF;
+	qy = (qy | (qy << 4)) & 0x0F0F0F0F;
+	qy = (qy | (qy << 2)) & 0x33333333;
+	qy = (qy | (qy << 1)) & 0x55555555;
+	return qx | (qy << 1);
+}
+
+void SpatialReorder::reorder(ThreadPool& pool){
+	int count = gBalls.size();
+	int blocks = std::max(1, std::min(pool.getConcurrency()*4, count/4096));
+	int blockSize = (count + blocks - 1)/blocks;
+
+	mKeys.resize(count);
+	mOrder.resize(count);
+	pool.parallelFor(blocks, [&](int block){
+		int end = std::min(count, (block + 1)*blockSize);
+		for(int i = block*blockSize; i < end; i++){
+			mKeys[i] = mKey == KEY_MORTON ? mortonKey(gColliders[i].x, gColliders[i].y, gWorldWidth, gWorldHeight) : gGrid.cellFor(gColliders[i].x, gColliders[i].y);
+			mOrder[i] = i;
+		}
+	});
+
+	radixSort(pool, mKey == KEY_MORTON ? 0xFFFFFFFF : gGrid.cellFor(gWorldWidth, gWorldHeight));
+
+	//Gather into the scratch arrays and swap them in. With --numa local fresh scratch gets its node policy
+	//before anything touches it, so its pages land with the threads that gather into them
+	if(gSettings.numaLocal && mBallScratch.capacity() < count){
+		mBallScratch.reserve(count);
+		mColliderScratch.reserve(count);
+		gNuma.place(mBallScratch.data(), count*sizeof(Ball));
+		gNuma.place(mColliderScratch.data(), count*sizeof(Circle));
+	}
+	mBallScratch.resize(count, gBalls[0]);
+	mColliderScratch.resize(count);
+	pool.parallelFor(blocks, [&](int block){
+		int end = std::min(count, (block + 1)*blockSize);
+		for(int i = block*blockSize; i < end; i++){
+			mBallScratch[i] = gBalls[mOrder[i]];
+			mColliderScratch[i] = gColliders[mOrder[i]];
+		}
+	});
+	gBalls.swap(mBallScratch);
+	gColliders.swap(mColliderScratch);
+
+	//Handles and grid cells follow the balls to their new places
+	gRegistry.permute(mOrder);
+	gGrid.permute(mOrder);
+	mReorders++;
+}
+
+void SpatialReorder::radixSort(ThreadPool& pool, Uint32 maxKey){
+	int count = mKeys.size();
+	int chunks = std::max(1, std::min(pool.getConcurrency()*4, count/4096));
+	int chunkSize = (count + chunks - 1)/chunks;
+	mKeysScratch.resize(count);
+	mOrderScratch.resize(count);
+	mHistograms.resize(chunks*256);
+
+	for(int shift = 0; shift < 32 && (maxKey >> shift) != 0; shift += 8){
+		//Digit counts per chunk
+		pool.parallelFor(chunks, [&](int chunk){
+			int* histogram = &mHistograms[chunk*256];
+			std::fill(histogram, histogram + 256, 0);
+			int end = std::min(count, (chunk + 1)*chunkSize);
+			for(int i = chunk*chunkSize; i < end; i++){
+				histogram[(mKeys[i] >> shift) & 0xFF]++;
+			}
+		});
+
+		//Digit-major prefix sum keeps equal digits in chunk order, which makes the pass stable
+		int total = 0;
+		for(int digit = 0; digit < 256; digit++){
+			for(int chunk = 0; chunk < chunks; chunk++){
+				int n = mHistograms[chunk*256 + digit];
+				mHistograms[chunk*256 + digit] = total;
+				total += n;
+			}
+		}
+
+		pool.parallelFor(chunks, [&](int chunk){
+			int* cursors = &mHistograms[chunk*256];
+			int end = std::min(count, (chunk + 1)*chunkSize);
+			for(int i = chunk*chunkSize; i < end; i++){
+				int to = cursors[(mKeys[i] >> shift) & 0xFF]++;
+				mKeysScratch[to] = mKeys[i];
+				mOrderScratch[to] = mOrder[i];
+			}
+		});
+		mKeys.swap(mKeysScratch);
+		mOrder.swap(mOrderScratch);
+	}
+}
+
+ContactSolver::ContactSolver(){
+	mCollisions = 0;
+}
+
+void ContactSolver::solve(ThreadPool& pool, int count){
+	findContacts(pool, count);
+	if(mContacts.empty()){
+		return;
+	}
+	buildIslands();
+
+	//Small islands are solved whole, a batch of islands per task, each one in contact order
+	mCollisions = 0;
+	int batches = (mSmall.size() + CHUNK_SIZE - 1)/CHUNK_SIZE;
+	pool.parallelFor(batches, [this](int batch){
+		int collisions = 0;
+		int end = std::min((int)mSmall.size(), (batch + 1)*CHUNK_SIZE);
+		for(int i = batch*CHUNK_SIZE; i < end; i++){
+			int island = mSmall[i];
+			for(int c = mIslandStart[island]; c < mIslandStart[island + 1]; c++){
+				collisions += calculateNewVel(gBalls[mSorted[c].a], gBalls[mSorted[c].b]);
+			}
+		}
+		mCollisions += collisions;
+	});
+
+	for(int island = 0; island + 1 < mIslandStart.size(); island++){
+		if(mIslandStart[island + 1] - mIslandStart[island] > GIANT_ISLAND){
+			solveGiant(pool, island);
+		}
+	}
+	gObservables.addCollisions(mCollisions);
+}
+
+void ContactSolver::findContacts(ThreadPool& pool, int count){
+	int chunks = (count + CHUNK_SIZE - 1)/CHUNK_SIZE;
+	if(mChunks.size() < chunks){
+		mChunks.resize(chunks);
+	}
+
+	//Balls below count are the ones being stepped, later ones are ghosts that only take part in a contact
+	pool.parallelFor(chunks, [this, count](int chunk){
+		Chunk& found = mChunks[chunk];
+		found.contacts.clear();
+		found.pairs = 0;
+		found.overlap = 0;
+		int end = std::min(count, (chunk + 1)*CHUNK_SIZE);
+		for(int a = chunk*CHUNK_SIZE; a < end; a++){
+			if(gBalls[a].isPocketed()){
+				continue;
+			}
+			Circle& circle = gColliders[a];
+			gGrid.query(circle.x, circle.y, [&found, &circle, a, count](int b){
+				if((b <= a && b < count) || gBalls[b].isPocketed()){
+					return;
+				}
+				found.pairs++;
+				Circle& other = gColliders[b];
+				if(checkCollision(circle, other)){
+					Contact contact = { a, b };
+					found.contacts.push_back(contact);
+					found.overlap = std::max(found.overlap, circle.r + other.r - distance(circle.x, circle.y, other.x, other.y));
+				}
+			});
+		}
+	});
+
+	mContacts.clear();
+	for(int chunk = 0; chunk < chunks; chunk++){
+		Chunk& found = mChunks[chunk];
+		mContacts.insert(mContacts.end(), found.contacts.begin(), found.contacts.end());
+		gTelemetry.current.broadphasePairs += found.pairs;
+		gTelemetry.current.narrowTests += found.pairs;
+		if(gMonitor.isEnabled()){
+			gMonitor.addOverlap(found.overlap);
+		}
+	}
+	gTelemetry.current.contacts += mContacts.size();
+}
+
+int ContactSolver::findRoot(int ball){
+	//Path halving keeps the trees flat without a second pass
+	while(mParent[ball] != ball){
+		mParent[ball] = mParent[mParent[ball]];
+		ball = mParent[ball];
+	}
+	return ball;
+}
+
+void ContactSolver::join(int a, int b){
+	a = findRoot(a);
+	b = findRoot(b);
+	if(a < b){
+		mParent[b] = a;
+	}
+	else if(b < a){
+		mParent[a] = b;
+	}
+}
+
+void ContactSolver::buildIslands(){
+	int n = gBalls.size();
+	mParent.resize(n);
+	for(int i = 0; i < n; i++){
+		mParent[i] = i;
+	}
+	for(int c = 0; c < mContacts.size(); c++){
+		join(mContacts[c].a, mContacts[c].b);
+	}
+
+	//Number the islands in order of their first contact and count their contacts
+	mIslandOf.assign(n, -1);
+	mIslandStart.clear();
+	for(int c = 0; c < mContacts.size(); c++){
+		int root = findRoot(mContacts[c].a);
+		if(mIslandOf[root] < 0){
+			mIslandOf[root] = mIslandStart.size();
+			mIslandStart.push_back(0);
+		}
+		mIslandStart[mIslandOf[root]]++;
+	}
+	gTelemetry.current.islands += mIslandStart.size();
+
+	//Counting sort of the contacts by island
+	int offset = 0;
+	for(int island = 0; island < mIslandStart.size(); island++){
+		int size = mIslandStart[island];
+		mIslandStart[island] = offset;
+		offset += size;
+	}
+	mIslandStart.push_back(offset);
+	std::vector<int> next(mIslandStart.begin(), mIslandStart.end() - 1);
+	mSorted.resize(mContacts.size());
+	for(int c = 0; c < mContacts.size(); c++){
+		mSorted[next[mIslandOf[findRoot(mContacts[c].a)]]++] = mContacts[c];
+	}
+
+	mSmall.clear();
+	for(int island = 0; island + 1 < mIslandStart.size(); island++){
+		if(mIslandStart[island + 1] - mIslandStart[island] <= GIANT_ISLAND){
+			mSmall.push_back(island);
+		}
+	}
+}
+
+void ContactSolver::solveGiant(ThreadPool& pool, int island){
+	//Greedy edge colouring, each contact takes the lowest colour neither of its balls has used yet.
+	//Contacts of one colour share no ball so they can be solved at the same time. A ball touching
+	//more than 63 others overflows into the last colour, which is solved in order on this thread.
+	const int COLOURS = 65;
+	int first = mIslandStart[island], last = mIslandStart[island + 1];
+	if(mUsedColours.size() < gBalls.size()){
+		mUsedColours.resize(gBalls.size(), 0);
+	}
+	mColourOf.resize(last - first);
+	mColourStart.assign(COLOURS + 1, 0);
+	for(int c = first; c < last; c++){
+		Uint64 used = mUsedColours[mSorted[c].a] | mUsedColours[mSorted[c].b];
+		int colour = ~used ? __builtin_ctzll(~used) : COLOURS - 1;
+		if(colour < 64){
+			mUsedColours[mSorted[c].a] |= 1ULL << colour;
+			mUsedColours[mSorted[c].b] |= 1ULL << colour;
+		}
+		mColourOf[c - first] = colour;
+		mColourStart[colour + 1]++;
+	}
+	for(int colour = 0; colour < COLOURS; colour++){
+		mColourStart[colour + 1] += mColourStart[colour];
+	}
+	std::vector<int> next(mColourStart.begin(), mColourStart.end() - 1);
+	mColoured.resize(last - first);
+	for(int c = first; c < last; c++){
+		mColoured[next[mColourOf[c - first]]++] = mSorted[c];
+		mUsedColours[mSorted[c].a] = 0;
+		mUsedColours[mSorted[c].b] = 0;
+	}
+
+	for(int colour = 0; colour < COLOURS; colour++){
+		int begin = mColourStart[colour], end = mColourStart[colour + 1];
+		if(colour == COLOURS - 1){
+			for(int c = begin; c < end; c++){
+				mCollisions += calculateNewVel(gBalls[mColoured[c].a], gBalls[mColoured[c].b]);
+			}
+			continue;
+		}
+		pool.parallelFor((end - begin + CHUNK_SIZE - 1)/CHUNK_SIZE, [this, begin, end](int chunk){
+			int collisions = 0;
+			int stop = std::min(end, begin + (chunk + 1)*CHUNK_SIZE);
+			for(int c = begin + chunk*CHUNK_SIZE; c < stop; c++){
+				collisions += calculateNewVel(gBalls[mColoured[c].a], gBalls[mColoured[c].b]);
+			}
+			mCollisions += collisions;
+		});
+	}
+}
+
+Ensemble::Ensemble(){
+}
+
+bool Ensemble::load(std::string path){
+	FILE* file = fopen(path.c_str(), "r");
+	if(file == NULL){
+		printf("Unable to open %s! errno: %d\n", path.c_str(), errno);
+		return false;
+	}
+
+	//Missing columns take the screen size and the command line's speed, gravity and step
+	mTables.clear();
+	char line[256];
+	int lineNumber = 0;
+	while(fgets(line, sizeof(line), file) != NULL){
+		lineNumber++;
+		Table table = { 0, 0, SCREEN_WIDTH, SCREEN_HEIGHT, gSpawnSpeed, gSettings.gravity, gSettings.dt };
+		int fields = sscanf(line, "%u %d %lf %lf %lf %lf %lf", &table.seed, &table.balls, &table.width, &table.height, &table.speed, &table.gravity, &table.dt);
+		if(line[0] == '#' || fields <= 0){
+			continue;
+		}
+
+		int columns, rows;
+		if(fields < 2 || fields == 3 || table.balls <= 0 || table.dt <= 0 || !latticeShape(table, columns, rows)){
+			printf("%s:%d: bad table, expected \"seed balls [width height [speed [gravity [dt]]]]\" with room for the balls\n", path.c_str(), lineNumber);
+			fclose(file);
+			return false;
+		}
+		mTables.push_back(table);
+	}
+	fclose(file);
+	if(mTables.empty()){
+		printf("%s lists no tables\n", path.c_str());
+		return false;
+	}
+
+	//Tables of similar size share a batch so little of it is padding
+	std::vector<int> sorted(mTables.size());
+	for(int i = 0; i < sorted.size(); i++){
+		sorted[i] = i;
+	}
+	std::stable_sort(sorted.begin(), sorted.end(), [this](int a, int b){
+		return mTables[a].balls < mTables[b].balls;
+	});
+
+	mBatches.assign((mTables.size() + LANES - 1)/LANES, Batch());
+	for(int b = 0; b < mBatches.size(); b++){
+		Batch& batch = mBatches[b];
+		batch.tables = std::min(LANES, (int)mTables.size() - b*LANES);
+		batch.slots = mTables[sorted[b*LANES + batch.tables - 1]].balls;
+		batch.x.assign(batch.slots*LANES, 0);
+		batch.y.assign(batch.slots*LANES, 0);
+		batch.velX.assign(batch.slots*LANES, 0);
+		batch.velY.assign(batch.slots*LANES, 0);
+		batch.wallMs = 0;
+
+		//Unused lanes of the last batch hold no balls and never move
+		for(int lane = 0; lane < LANES; lane++){
+			Table table = { 0, 0, 4.0*Ball::BALL_WIDTH, 4.0*Ball::BALL_HEIGHT, 0, 0, 0 };
+			batch.table[lane] = -1;
+			if(lane < batch.tables){
+				batch.table[lane] = sorted[b*LANES + lane];
+				table = mTables[batch.table[lane]];
+			}
+			fill(batch, lane, table);
+		}
+	}
+	printf("Ensemble: %d tables in %d batches of %d\n", (int)mTables.size(), (int)mBatches.size(), LANES);
+	return true;
+}
+
+bool Ensemble::latticeShape(const Table& table, int& columns, int& rows){
+	double innerWidth = table.width - Ball::BALL_WIDTH, innerHeight = table.height - Ball::BALL_HEIGHT;
+	if(table.balls <= 0 || innerWidth <= 0 || innerHeight <= 0){
+		columns = rows = 1;
+		return table.balls == 0;
+	}
+	columns = std::max(1, (int)ceil(sqrt(table.balls*innerWidth/innerHeight)));
+	rows = (table.balls + columns - 1)/columns;
+	return innerWidth/columns >= Ball::BALL_WIDTH && innerHeight/rows >= Ball::BALL_HEIGHT;
+}
+
+void Ensemble::fill(Batch& batch, int lane, const Table& table){
+	batch.count[lane] = table.balls;
+	batch.width[lane] = table.width;
+	batch.height[lane] = table.height;
+	batch.gravity[lane] = table.gravity;
+	batch.dt[lane] = table.dt;
+	batch.wallImpulse[lane] = 0;
+	batch.collisions[lane] = 0;
+	batch.substeps[lane] = 0;
+	batch.order[lane].resize(table.balls);
+
+	//Jittered lattice like the benchmark's, with every center inside the walls, drawn from the table's own seed
+	srand(table.seed);
+	int columns, rows;
+	latticeShape(table, columns, rows);
+	double r = Ball::BALL_WIDTH/2.0;
+	double cellX = (table.width - Ball::BALL_WIDTH)/columns, cellY = (table.height - Ball::BALL_HEIGHT)/rows;
+	for(int slot = 0; slot < batch.slots; slot++){
+		int i = slot*LANES + lane;
+		if(slot >= table.balls){
+			batch.x[i] = table.width/2;
+			batch.y[i] = table.height/2;
+			batch.velX[i] = 0;
+			batch.velY[i] = 0;
+			continue;
+		}
+		batch.x[i] = r + (slot % columns)*cellX + (cellX - Ball::BALL_WIDTH)*(rand()/(RAND_MAX + 1.0));
+		batch.y[i] = r + (slot/columns)*cellY + (cellY - Ball::BALL_HEIGHT)*(rand()/(RAND_MAX + 1.0));
+		double angle = 2*PI*(rand()/(RAND_MAX + 1.0));
+		batch.velX[i] = table.speed*cos(angle);
+		batch.velY[i] = table.speed*sin(angle);
+		batch.order[lane][slot] = slot;
+	}
+	batch.startEnergy[lane] = energy(batch, lane);
+}
+
+bool Ensemble::run(ThreadPool& pool, int steps, std::string outputPath){
+	FILE* file = fopen(outputPath.c_str(), "w");
+	if(file == NULL){
+		printf("Unable to open %s! errno: %d\n", outputPath.c_str(), errno);
+		return false;
+	}
+
+	//Tables never interact, so a batch runs all its steps in one task and stays in that thread's cache
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	pool.parallelFor(mBatches.size(), [this, steps](int b){
+		Batch& batch = mBatches[b];
+		std::chrono::steady_clock::time_point batchStart = std::chrono::steady_clock::now();
+		for(int i = 0; i < steps; i++){
+			step(batch);
+		}
+		batch.wallMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - batchStart).count();
+	});
+	double wallMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+	//Rows in spec order
+	std::vector<int> batchOf(mTables.size()), laneOf(mTables.size());
+	double ballSteps = 0;
+	for(int b = 0; b < mBatches.size(); b++){
+		for(int lane = 0; lane < mBatches[b].tables; lane++){
+			batchOf[mBatches[b].table[lane]] = b;
+			laneOf[mBatches[b].table[lane]] = lane;
+			ballSteps += (double)mBatches[b].count[lane]*steps;
+		}
+	}
+	fprintf(file, "table,seed,balls,width,height,speed,gravity,dt,steps,simulated_s,temperature,mean_speed,energy_drift,pressure,ideal_pressure,compressibility,collision_frequency,mean_free_path,substeps_per_step,batch_ms\n");
+	for(int t = 0; t < mTables.size(); t++){
+		writeRow(file, mBatches[batchOf[t]], laneOf[t], steps);
+	}
+	fclose(file);
+	printf("Ensemble: %d tables, %d steps each, %.0f ms on %d threads, %.1f ns per ball-step, wrote %s\n",
+		(int)mTables.size(), steps, wallMs, pool.getConcurrency(), wallMs*1e6/std::max(1.0, ballSteps), outputPath.c_str());
+	return true;
+}
+
+void Ensemble::step(Batch& batch){
+	int substeps[LANES];
+	int most = substepsNeeded(batch, substeps);
+	for(int s = 0; s < most; s++){
+		move(batch, s, substeps);
+		for(int lane = 0; lane < batch.tables; lane++){
+			if(s < substeps[lane]){
+				collide(batch, lane);
+			}
+		}
+	}
+}
+
+int Ensemble::substepsNeeded(Batch& batch, int substeps[LANES]){
+	double maxStep = gSettings.substepFraction * Ball::BALL_WIDTH / 2;
+	if(maxStep <= 0){
+		for(int lane = 0; lane < LANES; lane++){
+			substeps[lane] = 1;
+			batch.substeps[lane]++;
+		}
+		return 1;
+	}
+
+	//Padding rests, so it never raises a lane's count
+	double fastest[LANES] = {};
+	const double* velX = &batch.velX[0];
+	const double* velY = &batch.velY[0];
+	for(int slot = 0; slot < batch.slots; slot++){
+		#pragma omp simd
+		for(int lane = 0; lane < LANES; lane++){
+			int i = slot*LANES + lane;
+			fastest[lane] = std::max(fastest[lane], velX[i]*velX[i] + velY[i]*velY[i]);
+		}
+	}
+	int most = 1;
+	for(int lane = 0; lane < LANES; lane++){
+		double travel = sqrt(fastest[lane])*batch.dt[lane];
+		substeps[lane] = std::min(Ball::MAX_SUBSTEPS, std::max(1, (int)ceil(travel / maxStep)));
+		batch.substeps[lane] += substeps[lane];
+		most = std::max(most, substeps[lane]);
+	}
+	return most;
+}
+
+void Ensemble::move(Batch& batch, int s, const int substeps[LANES]){
+	//Per lane constants, so the inner loop only does arithmetic and blends
+	double r = Ball::BALL_WIDTH/2.0;
+	double h[LANES], accel[LANES], right[LANES], bottom[LANES], impulse[LANES];
+	for(int lane = 0; lane < LANES; lane++){
+		h[lane] = s < substeps[lane] ? batch.dt[lane]/substeps[lane] : 0;
+		accel[lane] = batch.gravity[lane];
+		right[lane] = batch.width[lane] - r;
+		bottom[lane] = batch.height[lane] - r;
+		impulse[lane] = 0;
+	}
+
+	double* x = &batch.x[0];
+	double* y = &batch.y[0];
+	double* velX = &batch.velX[0];
+	double* velY = &batch.velY[0];
+	for(int slot = 0; slot < batch.slots; slot++){
+		#pragma omp simd
+		for(int lane = 0; lane < LANES; lane++){
+			int i = slot*LANES + lane;
+
+			//Padding must not fall, the rest is the same velocity Verlet as Ball::move
+			double g = slot < batch.count[lane] ? accel[lane] : 0;
+			double px = x[i] + velX[i]*h[lane];
+			double py = y[i] + velY[i]*h[lane] + 0.5*g*h[lane]*h[lane];
+			double vx = velX[i];
+			double vy = velY[i] + g*h[lane];
+
+			//Mirror off the walls. Along y the mirrored height is paid for out of the speed, like setPosition does
+			double mx = px < r ? 2*r - px : (px > right[lane] ? 2*right[lane] - px : px);
+			double my = py < r ? 2*r - py : (py > bottom[lane] ? 2*bottom[lane] - py : py);
+			double nvx = px < r ? fabs(vx) : (px > right[lane] ? -fabs(vx) : vx);
+			double speedY = sqrt(std::max(0.0, vy*vy + 2*g*(my - py)));
+			double nvy = py < r ? speedY : (py > bottom[lane] ? -speedY : vy);
+
+			impulse[lane] += Ball::BALL_MASS*(fabs(nvx - vx) + fabs(nvy - vy));
+			x[i] = mx;
+			y[i] = my;
+			velX[i] = nvx;
+			velY[i] = nvy;
+		}
+	}
+	for(int lane = 0; lane < LANES; lane++){
+		batch.wallImpulse[lane] += impulse[lane];
+	}
+}
+
+void Ensemble::collide(Batch& batch, int lane){
+	//Insertion sort, the order from the last substep is almost right
+	std::vector<int>& order = batch.order[lane];
+	const double* x = &batch.x[0];
+	double* y = &batch.y[0];
+	double* velX = &batch.velX[0];
+	double* velY = &batch.velY[0];
+	for(int k = 1; k < order.size(); k++){
+		int slot = order[k];
+		double key = x[slot*LANES + lane];
+		int j = k - 1;
+		while(j >= 0 && x[order[j]*LANES + lane] > key){
+			order[j + 1] = order[j];
+			j--;
+		}
+		order[j + 1] = slot;
+	}
+
+	//Only balls closer than a diameter along x can touch, solved in sweep order like calculateNewVel
+	double diameter = Ball::BALL_WIDTH;
+	Uint64 collisions = 0;
+	for(int k = 0; k < order.size(); k++){
+		int a = order[k]*LANES + lane;
+		for(int m = k + 1; m < order.size(); m++){
+			int b = order[m]*LANES + lane;
+			double dx = x[b] - x[a];
+			if(dx >= diameter){
+				break;
+			}
+			double dy = y[b] - y[a];
+			double distSq = dx*dx + dy*dy;
+			if(distSq >= diameter*diameter || distSq == 0){
+				continue;
+			}
+			double dist = sqrt(distSq);
+			double normalX = dx/dist, normalY = dy/dist;
+			double approach = (velX[a] - velX[b])*normalX + (velY[a] - velY[b])*normalY;
+			if(approach <= 0){
+				continue;
+			}
+			velX[a] -= approach*normalX;
+			velY[a] -= approach*normalY;
+			velX[b] += approach*normalX;
+			velY[b] += approach*normalY;
+			collisions++;
+		}
+	}
+	batch.collisions[lane] += collisions;
+}
+
+double Ensemble::energy(Batch& batch, int lane){
+	double total = 0;
+	for(int slot = 0; slot < batch.count[lane]; slot++){
+		int i = slot*LANES + lane;
+		total += 0.5*Ball::BALL_MASS*(batch.velX[i]*batch.velX[i] + batch.velY[i]*batch.velY[i]) + Ball::BALL_MASS*batch.gravity[lane]*(batch.height[lane] - batch.y[i]);
+	}
+	return total;
+}
+
+void Ensemble::writeRow(FILE* file, Batch& batch, int lane, int steps){
+	const Table& table = mTables[batch.table[lane]];
+	int n = table.balls;
+	double speedSqSum = 0, speedSum = 0;
+	for(int slot = 0; slot < n; slot++){
+		int i = slot*LANES + lane;
+		double speedSq = batch.velX[i]*batch.velX[i] + batch.velY[i]*batch.velY[i];
+		speedSqSum += speedSq;
+		speedSum += sqrt(speedSq);
+	}
+
+	//Same figures as GasObservables, over the whole run
+	double r = Ball::BALL_WIDTH/2.0;
+	double elapsed = steps*table.dt;
+	double temperature = 0.5*Ball::BALL_MASS*speedSqSum/n;
+	double meanSpeed = speedSum/n;
+	double area = (table.width - 2*r)*(table.height - 2*r);
+	double perimeter = 2*(table.width - 2*r + table.height - 2*r);
+	double pressure = batch.wallImpulse[lane]/(elapsed*perimeter);
+	double idealPressure = n*temperature/area;
+	double frequency = 2.0*batch.collisions[lane]/(n*elapsed);
+	double drift = batch.startEnergy[lane] != 0 ? energy(batch, lane)/batch.startEnergy[lane] - 1 : 0;
+	fprintf(file, "%d,%u,%d,%g,%g,%g,%g,%g,%d,%.4f,%.3f,%.3f,%.3e,%.5f,%.5f,%.4f,%.4f,%.3f,%.2f,%.3f\n", batch.table[lane], table.seed, n, table.width, table.height,
+		table.speed, table.gravity, table.dt, steps, elapsed, temperature, meanSpeed, drift, pressure, idealPressure, idealPressure > 0 ? pressure/idealPressure : 0,
+		frequency, frequency > 0 ? meanSpeed/frequency : 0, (double)batch.substeps[lane]/steps, batch.wallMs);
+}
+
+SocketTransport::SocketTransport(int domains){
+	mPeerFds.assign(domains + 1, -1);
+}
+
+SocketTransport::~SocketTransport(){
+	keepOnly(-2);
+}
+
+void SocketTransport::connect(int peer, int fd){
+	mPeerFds[peer + 1] = fd;
+}
+
+void SocketTransport::keepOnly(int rank){
+	for(int i = 0; i < mPeerFds.size(); i++){
+		if(mPeerFds[i] >= 0 && i - 1 != rank){
+			::close(mPeerFds[i]);
+			mPeerFds[i] = -1;
+		}
+	}
+}
+
+bool SocketTransport::send(int peer, int tag, const std::vector<BallState>& balls){
+	//Header carries the tag and the ball count
+	Uint32 header[2] = { (Uint32)tag, (Uint32)balls.size() };
+	int fd = mPeerFds[peer + 1];
+	if(!writeAll(fd, header, sizeof(header))){
+		return false;
+	}
+	return balls.empty() || writeAll(fd, &balls[0], balls.size()*sizeof(BallState));
+}
+
+bool SocketTransport::receive(int peer, int& tag, std::vector<BallState>& balls){
+	Uint32 header[2];
+	int fd = mPeerFds[peer + 1];
+	if(!readAll(fd, header, sizeof(header))){
+		return false;
+	}
+	tag = header[0];
+	balls.resize(header[1]);
+	return balls.empty() || readAll(fd, &balls[0], balls.size()*sizeof(BallState));
+}
+
+bool SocketTransport::writeAll(int fd, const void* data, size_t size){
+	const char* bytes = (const char*)data;
+	while(size > 0){
+		ssize_t written = ::write(fd, bytes, size);
+		if(written < 0 && errno == EINTR){
+			continue;
+		}
+		if(written <= 0){
+			return false;
+		}
+		bytes += written;
+		size -= written;
+	}
+	return true;
+}
+
+bool SocketTransport::readAll(int fd, void* data, size_t size){
+	char* bytes = (char*)data;
+	while(size > 0){
+		ssize_t got = ::read(fd, bytes, size);
+		if(got < 0 && errno == EINTR){
+			continue;
+		}
+		if(got <= 0){
+			return false;
+		}
+		bytes += got;
+		size -= got;
+	}
+	return true;
+}
+
+DomainSimulation::DomainSimulation(){
+	mTransport = NULL;
+}
+
+DomainSimulation::~DomainSimulation(){
+	stop();
+}
+
+bool DomainSimulation::start(int domains){
+	//Strips split the table, not the window, and must stay wider than the halo
+	double stripWidth = gWorldWidth / domains;
+	if(stripWidth < 4*Ball::BALL_WIDTH){
+		printf("A %.0f pixel wide table fits at most %d domains!\n", gWorldWidth, (int)(gWorldWidth / (4*Ball::BALL_WIDTH)));
+		return false;
+	}
+
+	//Sort the balls into strips by their center
+	std::vector< std::vector<BallState> > owned(domains);
+	for(int i = 0; i < gBalls.size(); i++){
+		BallState state = gBalls[i].getState();
+		int rank = (int)(state.posX / stripWidth);
+		if(rank < 0){
+			rank = 0;
+		}
+		if(rank >= domains){
+			rank = domains - 1;
+		}
+		owned[rank].push_back(state);
+	}
+
+	//Every worker talks to the coordinator and to its left and right neighbours
+	std::vector<int> toCoordinator(domains), toWorker(domains);
+	std::vector<int> leftEnd(domains, -1), rightEnd(domains, -1);
+	for(int rank = 0; rank < domains; rank++){
+		int fds[2];
+		if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0){
+			printf("Unable to create domain socket! %s\n", strerror(errno));
+			return false;
+		}
+		toWorker[rank] = fds[0];
+		toCoordinator[rank] = fds[1];
+
+		if(rank + 1 < domains){
+			if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0){
+				printf("Unable to create domain socket! %s\n", strerror(errno));
+				return false;
+			}
+			rightEnd[rank] = fds[0];
+			leftEnd[rank + 1] = fds[1];
+		}
+	}
+
+	for(int rank = 0; rank < domains; rank++){
+		pid_t pid = fork();
+		if(pid < 0){
+			printf("Unable to fork domain worker! %s\n", strerror(errno));
+			return false;
+		}
+		if(pid == 0){
+			//Keep only this worker's own socket ends
+			SocketTransport transport(domains);
+			for(int other = 0; other < domains; other++){
+				::close(toWorker[other]);
+				if(other != rank){
+					::close(toCoordinator[other]);
+					if(rightEnd[other] >= 0){
+						::close(rightEnd[other]);
+					}
+					if(leftEnd[other] >= 0){
+						::close(leftEnd[other]);
+					}
+				}
+			}
+			transport.connect(DomainTransport::COORDINATOR, toCoordinator[rank]);
+			if(rank > 0){
+				transport.connect(rank - 1, leftEnd[rank]);
+			}
+			if(rank + 1 < domains){
+				transport.connect(rank + 1, rightEnd[rank]);
+			}
+
+			runWorker(rank, domains, transport, owned[rank]);
+
+			//Skip the parent's SDL teardown and static destructors
+			_exit(0);
+		}
+		mWorkers.push_back(pid);
+	}
+
+	//The coordinator only keeps its end of each worker link
+	mTransport = new SocketTransport(domains);
+	for(int rank = 0; rank < domains; rank++){
+		::close(toCoordinator[rank]);
+		if(rightEnd[rank] >= 0){
+			::close(rightEnd[rank]);
+		}
+		if(leftEnd[rank] >= 0){
+			::close(leftEnd[rank]);
+		}
+		mTransport->connect(rank, toWorker[rank]);
+	}
+
+	return true;
+}
+
+bool DomainSimulation::step(){
+	//Kick every worker, then gather their owned balls
+	std::vector<BallState> none, result;
+	for(int rank = 0; rank < mWorkers.size(); rank++){
+		if(!mTransport->send(rank, DomainTransport::TAG_STEP, none)){
+			return false;
+		}
+	}
+
+	clearBalls();
+	for(int rank = 0; rank < mWorkers.size(); rank++){
+		int tag;
+		if(!mTransport->receive(rank, tag, result) || tag != DomainTransport::TAG_RESULTS){
+			return false;
+		}
+		for(int i = 0; i < result.size(); i++){
+			Ball ball(0, 0, 0, 0);
+			ball.setState(result[i]);
+			spawnBall(ball);
+		}
+	}
+	return true;
+}
+
+void DomainSimulation::stop(){
+	if(mTransport == NULL){
+		return;
+	}
+
+	std::vector<BallState> none;
+	for(int rank = 0; rank < mWorkers.size(); rank++){
+		mTransport->send(rank, DomainTransport::TAG_QUIT, none);
+	}
+	delete mTransport;
+	mTransport = NULL;
+
+	for(int rank = 0; rank < mWorkers.size(); rank++){
+		waitpid(mWorkers[rank], NULL, 0);
+	}
+	mWorkers.clear();
+}
+
+bool DomainSimulation::isRunning(){
+	return mTransport != NULL;
+}
+
+bool DomainSimulation::exchange(DomainTransport& transport, int rank, int peer, int tag, const std::vector<BallState>& out, std::vector<BallState>& in){
+	//The lower rank of each pair sends first so both never block on a full socket
+	int gotTag;
+	if(rank < peer){
+		return transport.send(peer, tag, out) && transport.receive(peer, gotTag, in) && gotTag == tag;
+	}
+	return transport.receive(peer, gotTag, in) && gotTag == tag && transport.send(peer, tag, out);
+}
+
+void DomainSimulation::runWorker(int rank, int domains, DomainTransport& transport, std::vector<BallState>& owned){
+	double stripWidth = gWorldWidth / domains;
+	double minX = rank * stripWidth;
+	double maxX = (rank + 1 == domains) ? gWorldWidth : minX + stripWidth;
+
+	//Balls this close to a border can touch a ball on the other side this step
+	int halo = 4 * Ball::BALL_WIDTH;
+
+	std::vector<BallState> none, toLeft, toRight, fromLeft, fromRight;
+	while(true){
+		int tag;
+		if(!transport.receive(DomainTransport::COORDINATOR, tag, none) || tag != DomainTransport::TAG_STEP){
+			break;
+		}
+		gTelemetry.current = StepCounters();
+
+		//Ghost copies of the balls near each border
+		toLeft.clear();
+		toRight.clear();
+		for(int i = 0; i < owned.size(); i++){
+			if(rank > 0 && owned[i].posX < minX + halo){
+				toLeft.push_back(owned[i]);
+			}
+			if(rank + 1 < domains && owned[i].posX >= maxX - halo){
+				toRight.push_back(owned[i]);
+			}
+		}
+		fromLeft.clear();
+		fromRight.clear();
+		if(rank > 0 && !exchange(transport, rank, rank - 1, DomainTransport::TAG_GHOSTS, toLeft, fromLeft)){
+			break;
+		}
+		if(rank + 1 < domains && !exchange(transport, rank, rank + 1, DomainTransport::TAG_GHOSTS, toRight, fromRight)){
+			break;
+		}
+
+		//Owned balls first, ghosts after so indices below owned.size() are ours
+		clearBalls();
+		for(int pass = 0; pass < 3; pass++){
+			std::vector<BallState>& source = pass == 0 ? owned : (pass == 1 ? fromLeft : fromRight);
+			for(int i = 0; i < source.size(); i++){
+				Ball ball(0, 0, 0, 0);
+				ball.setState(source[i]);
+				spawnBall(ball);
+			}
+		}
+
+		//Only owned balls are moved through the table, changes made to ghosts are dropped
+		nudgeBallLoop();
+		int substeps = substepsNeeded(gBalls.size());
+		double h = gSettings.dt / substeps;
+		for(int step = 0; step < substeps; step++){
+			moveBalls(owned.size(), h);
+
+			//Ghosts fly on ballistically between exchanges, so a fast ball near the border is met where it is by now and
+			//not where it was at the start of the step. Cushions are left to the owner
+			for(int i = owned.size(); i < gBalls.size(); i++){
+				BallState state = gBalls[i].getState();
+				state.posX += state.velX*h;
+				state.posY += state.velY*h + 0.5*gSettings.gravity*h*h;
+				state.velY += gSettings.gravity*h;
+				gBalls[i].setState(state);
+				gColliders[i] = gBalls[i].getCollider();
+				gGrid.update(i, gColliders[i].x, gColliders[i].y);
+			}
+			gContacts.solve(gThreadPool, owned.size());
+		}
+
+		//Balls that crossed a border migrate to the neighbour
+		toLeft.clear();
+		toRight.clear();
+		std::vector<BallState> staying;
+		for(int i = 0; i < owned.size(); i++){
+			BallState state = gBalls[i].getState();
+			if(state.pocketed){
+				continue;
+			}
+			if(rank > 0 && state.posX < minX){
+				toLeft.push_back(state);
+			}
+			else if(rank + 1 < domains && state.posX >= maxX){
+				toRight.push_back(state);
+			}
+			else{
+				staying.push_back(state);
+			}
+		}
+		fromLeft.clear();
+		fromRight.clear();
+		if(rank > 0 && !exchange(transport, rank, rank - 1, DomainTransport::TAG_MIGRANTS, toLeft, fromLeft)){
+			break;
+		}
+		if(rank + 1 < domains && !exchange(transport, rank, rank + 1, DomainTransport::TAG_MIGRANTS, toRight, fromRight)){
+			break;
+		}
+		owned.swap(staying);
+		owned.insert(owned.end(), fromLeft.begin(), fromLeft.end());
+		owned.insert(owned.end(), fromRight.begin(), fromRight.end());
+
+		if(!transport.send(DomainTransport::COORDINATOR, DomainTransport::TAG_RESULTS, owned)){
+			break;
+		}
+	}
 }
 
-void LTexture::render(int x, int y, SDL_Rect* clip, double angle, SDL_Point* center, SDL_RendererFlip flip){
-	//Set rendering space and render to screen
-	SDL_Rect renderQuad = { x, y, mWidth, mHeight };
+void StepCounters::add(const StepCounters& other){
+	substeps += other.substeps;
+	broadphasePairs += other.broadphasePairs;
+	narrowTests += other.narrowTests;
+	contacts += other.contacts;
+	nudges += other.nudges;
+	wallBounces += other.wallBounces;
+	islands += other.islands;
+}
 
-	//Set clip rendering dimensions
-	if( clip != NULL )
-	{
-		renderQuad.w = clip->w;
-		renderQuad.h = clip->h;
+Telemetry::Telemetry(){
+	mEnabled = false;
+	mBudgetUs = 0;
+	mSteps = 0;
+	memset(&current, 0, sizeof(current));
+}
+
+void Telemetry::start(int capacity, double budgetUs){
+	if(capacity < 1){
+		capacity = 1;
 	}
+	mRing.resize(capacity);
+	mSteps = 0;
+	mBudgetUs = budgetUs;
+	mStart = std::chrono::steady_clock::now();
+	mEnabled = true;
+}
 
-	//Render to screen
-	SDL_RenderCopyEx(gRenderer, mTexture, clip, &renderQuad, angle, center, flip);
+bool Telemetry::isEnabled(){
+	return mEnabled;
 }
 
-int LTexture::getWidth(){
-	return mWidth;
+void Telemetry::beginStep(StepStats& stats, Uint64 step){
+	memset(&stats, 0, sizeof(stats));
+	stats.step = step;
+	if(mEnabled){
+		stats.startUs = now();
+	}
 }
 
-int LTexture::getHeight(){
-	return mHeight;
+void Telemetry::record(const StepStats& stats){
+	if(!mEnabled){
+		return;
+	}
+
+	//Oldest entry is overwritten once the ring is full
+	mRing[mSteps % mRing.size()] = stats;
+	mSteps++;
 }
 
-Ball::Ball(int x, int y, int velX, int velY){
-    //Initialize the offsets
-    mPosX = x;
-    mPosY = y;
+void Telemetry::beginPhase(StepStats& stats, Phase phase){
+	if(mEnabled){
+		stats.phaseStartUs[phase] = now() - stats.startUs;
+	}
+}
 
-	//Set collision circle size
-	mCollider.r = gBallTexture.getWidth() / 2;
+void Telemetry::endPhase(StepStats& stats, Phase phase){
+	if(mEnabled){
+		stats.phaseUs[phase] = now() - stats.startUs - stats.phaseStartUs[phase];
+	}
+}
 
-    //Initialize the velocity
-    mVelX = velX;
-    mVelY = velY;
+double Telemetry::now(){
+	return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - mStart).count();
+}
 
-	//Move collider relative to the circle
-	shiftColliders();
+size_t Telemetry::recordedCount(){
+	return mSteps < mRing.size() ? mSteps : mRing.size();
 }
-//moves and checks if the object circle collides with the argument circle
-void Ball::move(int currentBall){
 
-    //Move the ball left or right
-    mPosX += mVelX;
-	shiftColliders();
+const StepStats& Telemetry::recorded(size_t i){
+	size_t first = mSteps - recordedCount();
+	return mRing[(first + i) % mRing.size()];
+}
 
-	//Move the ball up or down
-    mPosY += mVelY;
-	shiftColliders();
+//Phase names used in every export
+static const char* PHASE_NAMES[Telemetry::PHASE_COUNT] = { "input", "nudge", "move", "draw_list", "overlay", "render", "capture", "present" };
 
-    //for every collider in gCollider
-    for(int i = 0; i < gColliders.size(); i++){
-		//If the ball collided or went too far to the left or right and it is not the current ball
+//Trace thread of each phase, 1 is the main thread and 2 the simulation worker
+static const int PHASE_THREADS[Telemetry::PHASE_COUNT] = { 1, 2, 2, 2, 1, 1, 1, 1 };
 
-	    if( (i != currentBall)&&( (mPosX-mCollider.r < 0) || (mPosX + mCollider.r > SCREEN_WIDTH))){
-	        //Reverse x direction
-	        mVelX = -1*mVelX;
-			shiftColliders();
-	    }
-	    //If the ball collided or went too far to the up and down and it is not the current ball
-	    if( (i != currentBall)&& ((mPosY-mCollider.r < 0) || (mPosY + mCollider.r > SCREEN_HEIGHT))){
-	        //Reverse y direction
-			mVelY = -1*mVelY;
-			shiftColliders();
-	    }
+bool Telemetry::exportCSV(std::string path){
+	FILE* file = fopen(path.c_str(), "w");
+	if(file == NULL){
+		return false;
+	}
+
+	fprintf(file, "step,start_us");
+	for(int p = 0; p < PHASE_COUNT; p++){
+		fprintf(file, ",%s_us", PHASE_NAMES[p]);
+	}
+	fprintf(file, ",substeps,broadphase_pairs,narrow_tests,contacts,nudges,wall_bounces,islands\n");
+
+	for(size_t i = 0; i < recordedCount(); i++){
+		const StepStats& stats = recorded(i);
+		fprintf(file, "%llu,%.1f", (unsigned long long)stats.step, stats.startUs);
+		for(int p = 0; p < PHASE_COUNT; p++){
+			fprintf(file, ",%.1f", stats.phaseUs[p]);
+		}
+		const StepCounters& counters = stats.counters;
+		fprintf(file, ",%d,%d,%d,%d,%d,%d,%d\n", counters.substeps, counters.broadphasePairs, counters.narrowTests, counters.contacts, counters.nudges, counters.wallBounces, counters.islands);
+	}
+
+	fclose(file);
+	return true;
+}
+
+bool Telemetry::exportJSON(std::string path){
+	FILE* file = fopen(path.c_str(), "w");
+	if(file == NULL){
+		return false;
+	}
+
+	fprintf(file, "[\n");
+	for(size_t i = 0; i < recordedCount(); i++){
+		const StepStats& stats = recorded(i);
+		fprintf(file, "  {\"step\": %llu, \"start_us\": %.1f", (unsigned long long)stats.step, stats.startUs);
+		for(int p = 0; p < PHASE_COUNT; p++){
+			fprintf(file, ", \"%s_us\": %.1f", PHASE_NAMES[p], stats.phaseUs[p]);
+		}
+		fprintf(file, ", \"substeps\": %d, \"broadphase_pairs\": %d, \"narrow_tests\": %d, \"contacts\": %d, \"nudges\": %d, \"wall_bounces\": %d, \"islands\": %d}%s\n",
+			stats.counters.substeps, stats.counters.broadphasePairs, stats.counters.narrowTests, stats.counters.contacts, stats.counters.nudges, stats.counters.wallBounces, stats.counters.islands, i + 1 < recordedCount() ? "," : "");
+	}
+	fprintf(file, "]\n");
+
+	fclose(file);
+	return true;
+}
+
+bool Telemetry::exportChromeTrace(std::string path){
+	FILE* file = fopen(path.c_str(), "w");
+	if(file == NULL){
+		return false;
+	}
+
+	//Trace event format, loadable in chrome://tracing or Perfetto
+	fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+	fprintf(file, "  {\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": {\"name\": \"BouncingBall\"}}");
+	fprintf(file, ",\n  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 1, \"args\": {\"name\": \"main\"}}");
+	fprintf(file, ",\n  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 2, \"args\": {\"name\": \"simulation\"}}");
+	for(size_t i = 0; i < recordedCount(); i++){
+		const StepStats& stats = recorded(i);
+
+		//Whole step as an async slice since consecutive steps overlap, phases on their own threads
+		double stepUs = 0;
+		for(int p = 0; p < PHASE_COUNT; p++){
+			if(stats.phaseUs[p] > 0 && stats.phaseStartUs[p] + stats.phaseUs[p] > stepUs){
+				stepUs = stats.phaseStartUs[p] + stats.phaseUs[p];
+			}
+		}
+		fprintf(file, ",\n  {\"name\": \"step\", \"cat\": \"step\", \"ph\": \"b\", \"id\": %llu, \"pid\": 1, \"ts\": %.1f}",
+			(unsigned long long)stats.step, stats.startUs);
+		fprintf(file, ",\n  {\"name\": \"step\", \"cat\": \"step\", \"ph\": \"e\", \"id\": %llu, \"pid\": 1, \"ts\": %.1f}",
+			(unsigned long long)stats.step, stats.startUs + stepUs);
+		for(int p = 0; p < PHASE_COUNT; p++){
+			if(stats.phaseUs[p] > 0){
+				fprintf(file, ",\n  {\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.1f, \"dur\": %.1f, \"args\": {\"step\": %llu}}",
+					PHASE_NAMES[p], PHASE_THREADS[p], stats.startUs + stats.phaseStartUs[p], stats.phaseUs[p], (unsigned long long)stats.step);
+			}
+		}
+
+		//Counters show up as stacked graphs above the slices
+		fprintf(file, ",\n  {\"name\": \"physics\", \"ph\": \"C\", \"pid\": 1, \"ts\": %.1f, \"args\": {\"substeps\": %d, \"broadphase_pairs\": %d, \"narrow_tests\": %d, \"contacts\": %d, \"nudges\": %d, \"wall_bounces\": %d, \"islands\": %d}}",
+			stats.startUs, stats.counters.substeps, stats.counters.broadphasePairs, stats.counters.narrowTests, stats.counters.contacts, stats.counters.nudges, stats.counters.wallBounces, stats.counters.islands);
+
+		//Flag steps that blew the frame budget
+		if(stepUs > mBudgetUs){
+			fprintf(file, ",\n  {\"name\": \"over budget\", \"ph\": \"i\", \"s\": \"t\", \"pid\": 1, \"tid\": 1, \"ts\": %.1f, \"args\": {\"step_us\": %.1f}}",
+				stats.startUs, stepUs);
+		}
+	}
+	fprintf(file, "\n]}\n");
+
+	fclose(file);
+	return true;
+}
+
+GasObservables::GasObservables(){
+	mEnabled = false;
+	mEvery = 0;
+	mFile = NULL;
+	mHistogramFile = NULL;
+	mRows = 0;
+	mWallImpulse = 0;
+	mCollisions = 0;
+	mElapsed = 0;
+	mSteps = 0;
+}
+
+GasObservables::~GasObservables(){
+	stop();
+}
+
+bool GasObservables::start(std::string prefix, int every){
+	std::string path = prefix + ".csv";
+	std::string histogramPath = prefix + ".hist.csv";
+	mFile = fopen(path.c_str(), "w");
+	if(mFile == NULL){
+		printf("Unable to open %s! errno: %d\n", path.c_str(), errno);
+		return false;
+	}
+	mHistogramFile = fopen(histogramPath.c_str(), "w");
+	if(mHistogramFile == NULL){
+		printf("Unable to open %s! errno: %d\n", histogramPath.c_str(), errno);
+		fclose(mFile);
+		mFile = NULL;
+		return false;
+	}
+	fprintf(mFile, "step,time,balls,temperature,mean_speed,mb_distance,pressure,ideal_pressure,compressibility,collision_frequency,mean_free_path,mean_free_path_dilute\n");
+	fprintf(mHistogramFile, "step,bin,speed_low,speed_high,count,expected\n");
+	mPrefix = prefix;
+	mEvery = every;
+	mRows = 0;
+	mWallImpulse = 0;
+	mCollisions = 0;
+	mElapsed = 0;
+	mSteps = 0;
+	mEnabled = true;
+	return true;
+}
+
+bool GasObservables::isEnabled(){
+	return mEnabled;
+}
+
+void GasObservables::addWallImpulse(double impulse){
+	mWallImpulse += impulse;
+}
+
+void GasObservables::addCollisions(int count){
+	mCollisions += count;
+}
+
+void GasObservables::endStep(Uint64 step){
+	mElapsed += gSettings.dt;
+	mSteps++;
+	if(mSteps >= mEvery){
+		emit(step);
+		mWallImpulse = 0;
+		mCollisions = 0;
+		mElapsed = 0;
+		mSteps = 0;
+	}
+}
+
+void GasObservables::emit(Uint64 step){
+	int n = gBalls.size();
+	if(n == 0 || mElapsed <= 0){
+		return;
+	}
+
+	//One pass for the speeds and their moments, written so the compiler can vectorise it
+	mSpeeds.resize(n);
+	double* speeds = &mSpeeds[0];
+	const Ball* balls = &gBalls[0];
+	double speedSqSum = 0, speedSum = 0;
+	#pragma omp simd reduction(+:speedSqSum, speedSum)
+	for(int i = 0; i < n; i++){
+		double speedSq = balls[i].mVelX*balls[i].mVelX + balls[i].mVelY*balls[i].mVelY;
+		speeds[i] = sqrt(speedSq);
+		speedSqSum += speedSq;
+		speedSum += speeds[i];
+	}
+
+	//Two degrees of freedom per ball, so the mean kinetic energy is kT
+	double temperature = 0.5*Ball::BALL_MASS*speedSqSum/n;
+	double meanSpeed = speedSum/n;
+
+	//Speed histogram against the 2D Maxwell-Boltzmann distribution, whose CDF is 1 - exp(-m v^2 / 2kT)
+	int counts[SPEED_BINS] = {};
+	double width = temperature > 0 ? 4*sqrt(2*temperature/Ball::BALL_MASS)/SPEED_BINS : 1;
+	for(int i = 0; i < n; i++){
+		counts[std::min(SPEED_BINS - 1, (int)(speeds[i]/width))]++;
+	}
+	//Balls that are all at rest have no distribution to compare with, expected counts and the distance stay zero
+	double distance = 0;
+	for(int bin = 0; bin < SPEED_BINS; bin++){
+		double low = bin*width, high = (bin + 1)*width;
+		double expected = 0;
+		if(temperature > 0){
+			expected = n*exp(-Ball::BALL_MASS*low*low/(2*temperature));
+			if(bin + 1 < SPEED_BINS){
+				expected -= n*exp(-Ball::BALL_MASS*high*high/(2*temperature));
+			}
+			distance += fabs(counts[bin] - expected);
+		}
+		fprintf(mHistogramFile, "%llu,%d,%.3f,%.3f,%d,%.2f\n", (unsigned long long)step, bin, low, bin + 1 < SPEED_BINS ? high : INFINITY, counts[bin], expected);
+	}
+	distance /= 2*n;
+
+	//Centers stay a radius inside the walls, so the gas lives in the smaller box they can reach. A periodic
+	//table has no walls, the whole table is reachable and the pressure columns stay at zero
+	double r = gTable.isPeriodic() ? 0 : Ball::BALL_WIDTH/2.0;
+	double width2D = std::max(1.0, gWorldWidth - 2*r), height2D = std::max(1.0, gWorldHeight - 2*r);
+	double area = width2D*height2D;
+	double perimeter = 2*(width2D + height2D);
+
+	//Pressure is force per unit of wall length, compared with N kT / A
+	double pressure = mWallImpulse/(mElapsed*perimeter);
+	double idealPressure = n*temperature/area;
+
+	//Every collision ends the free flight of two balls. A ball sweeps a strip two diameters wide, so a dilute gas
+	//of hard discs has a mean free path of 1 / (2 sqrt(2) n d)
+	double frequency = 2*mCollisions/(n*mElapsed);
+	double meanFreePath = frequency > 0 ? meanSpeed/frequency : 0;
+	double dilutePath = area/(2*sqrt(2.0)*n*Ball::BALL_WIDTH);
+
+	fprintf(mFile, "%llu,%.4f,%d,%.3f,%.3f,%.4f,%.5f,%.5f,%.4f,%.4f,%.3f,%.3f\n", (unsigned long long)step, (step + 1)*gSettings.dt, n, temperature, meanSpeed, distance,
+		pressure, idealPressure, idealPressure > 0 ? pressure/idealPressure : 0, frequency, meanFreePath, dilutePath);
+	mRows++;
+}
+
+void GasObservables::stop(){
+	if(!mEnabled){
+		return;
+	}
+	fclose(mFile);
+	fclose(mHistogramFile);
+	mFile = NULL;
+	mHistogramFile = NULL;
+	mEnabled = false;
+	printf("Wrote %d rows of gas observables to %s.csv and %s.hist.csv\n", mRows, mPrefix.c_str(), mPrefix.c_str());
+}
+
+ConservationMonitor::ConservationMonitor(){
+	mEnabled = false;
+	mTolerance = 0;
+	mOverlapLimit = 0;
+	mTrackMomentum = false;
+	mHaveReference = false;
+	mEnergy0 = 0;
+	mMomentumX0 = 0;
+	mMomentumY0 = 0;
+	mWallImpulseX = 0;
+	mWallImpulseY = 0;
+	mGravityImpulseY = 0;
+	mRemovedEnergy = 0;
+	mRemovedMomentumX = 0;
+	mRemovedMomentumY = 0;
+	mOverlap = 0;
+	mMaxEnergyDrift = 0;
+	mMaxMomentumDrift = 0;
+	mMaxOverlap = 0;
+	mFlaggedSteps = 0;
+	mFlagging = false;
+	mMonitorUs = 0;
+	mStepUs = 0;
+	mChecks = 0;
+}
+
+void ConservationMonitor::start(double tolerance, double overlapLimit, bool trackMomentum){
+	mTolerance = tolerance;
+	mOverlapLimit = overlapLimit;
+	mTrackMomentum = trackMomentum;
+	mHaveReference = false;
+	mEnabled = true;
+}
+
+bool ConservationMonitor::isEnabled(){
+	return mEnabled;
+}
+
+void ConservationMonitor::addWallImpulse(double x, double y){
+	mWallImpulseX += x;
+	mWallImpulseY += y;
+}
+
+void ConservationMonitor::addGravityImpulse(double y){
+	mGravityImpulseY += y;
+}
+
+void ConservationMonitor::addRemoved(double energy, double momentumX, double momentumY){
+	mRemovedEnergy += energy;
+	mRemovedMomentumX += momentumX;
+	mRemovedMomentumY += momentumY;
+}
+
+void ConservationMonitor::resetReference(){
+	mHaveReference = false;
+}
+
+void ConservationMonitor::addOverlap(double depth){
+	if(depth > mOverlap){
+		mOverlap = depth;
+	}
+}
+
+void ConservationMonitor::addStepTime(double us){
+	mStepUs += us;
+}
+
+void ConservationMonitor::check(Uint64 step){
+	std::chrono::steady_clock::time_point checkStart = std::chrono::steady_clock::now();
+
+	//One pass over the velocities, written so the compiler can vectorise the sums
+	double energy = 0, height = 0, momentumX = 0, momentumY = 0, speedSum = 0;
+	int n = gBalls.size();
+	const Ball* balls = n > 0 ? &gBalls[0] : NULL;
+	#pragma omp simd reduction(+:energy, height, momentumX, momentumY, speedSum)
+	for(int i = 0; i < n; i++){
+		//Pocketed balls are stopped, so they add nothing
+		double vx = balls[i].mVelX;
+		double vy = balls[i].mVelY;
+		double speedSq = vx*vx + vy*vy;
+		energy += speedSq;
+		height += gWorldHeight - balls[i].mPosY;
+		momentumX += vx;
+		momentumY += vy;
+		speedSum += sqrt(speedSq);
+	}
+	//Potential energy is measured from the bottom edge so the total stays positive
+	energy = 0.5*Ball::BALL_MASS*energy + Ball::BALL_MASS*gSettings.gravity*height;
+	momentumX *= Ball::BALL_MASS;
+	momentumY *= Ball::BALL_MASS;
+	speedSum *= Ball::BALL_MASS;
+
+	if(!mHaveReference){
+		mEnergy0 = energy;
+		mMomentumX0 = momentumX;
+		mMomentumY0 = momentumY;
+		mWallImpulseX = 0;
+		mWallImpulseY = 0;
+		mGravityImpulseY = 0;
+		mRemovedEnergy = 0;
+		mRemovedMomentumX = 0;
+		mRemovedMomentumY = 0;
+		mHaveReference = true;
+	}
+
+	//Energy drift relative to the start, momentum drift relative to the total momentum magnitude
+	double energyDrift = mEnergy0 > 0 ? fabs(energy + mRemovedEnergy - mEnergy0)/mEnergy0 : 0;
+	double momentumDrift = 0;
+	if(mTrackMomentum && speedSum > 0){
+		double errorX = momentumX + mRemovedMomentumX - (mMomentumX0 + mWallImpulseX);
+		double errorY = momentumY + mRemovedMomentumY - (mMomentumY0 + mWallImpulseY + mGravityImpulseY);
+		momentumDrift = sqrt(errorX*errorX + errorY*errorY)/speedSum;
+	}
+
+	if(energyDrift > mMaxEnergyDrift){
+		mMaxEnergyDrift = energyDrift;
+	}
+	if(momentumDrift > mMaxMomentumDrift){
+		mMaxMomentumDrift = momentumDrift;
+	}
+	if(mOverlap > mMaxOverlap){
+		mMaxOverlap = mOverlap;
+	}
+
+	//Report only when a step first goes out of bounds, not on every step after
+	bool outOfBounds = energyDrift > mTolerance || momentumDrift > mTolerance || mOverlap > mOverlapLimit;
+	if(outOfBounds){
+		mFlaggedSteps++;
+		if(!mFlagging){
+			printf("Step %llu: energy drift %.3f%%, momentum drift %.3f%%, overlap %.2f px exceed limits\n",
+				(unsigned long long)step, 100*energyDrift, 100*momentumDrift, mOverlap);
+		}
+	}
+	mFlagging = outOfBounds;
+	mOverlap = 0;
+
+	mChecks++;
+	mMonitorUs += std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - checkStart).count();
+}
+
+void ConservationMonitor::report(){
+	printf("Conservation monitor: %llu steps, %d flagged, max energy drift %.3f%%, max momentum drift %.3f%%, max overlap %.2f px\n",
+		(unsigned long long)mChecks, mFlaggedSteps, 100*mMaxEnergyDrift, 100*mMaxMomentumDrift, mMaxOverlap);
+	if(mStepUs > 0){
+		printf("Conservation monitor overhead: %.2f%% of step time\n", 100*mMonitorUs/mStepUs);
+	}
+}
+
+TableGeometry::TableGeometry(){
+	mWidth = 0;
+	mHeight = 0;
+	mPeriodic = false;
+}
+
+void TableGeometry::buildBox(double width, double height){
+	mWidth = width;
+	mHeight = height;
+	mPeriodic = false;
+	mSegments.clear();
+	mPockets.clear();
+
+	Segment top = { 0, 0, width, 0, true };
+	Segment right = { width, 0, width, height, true };
+	Segment bottom = { width, height, 0, height, true };
+	Segment left = { 0, height, 0, 0, true };
+	mSegments.push_back(top);
+	mSegments.push_back(right);
+	mSegments.push_back(bottom);
+	mSegments.push_back(left);
+
+	mNodes.clear();
+	buildNode(0, mSegments.size());
+}
+
+void TableGeometry::buildBilliard(double width, double height, double pocketRadius){
+	mWidth = width;
+	mHeight = height;
+	mPeriodic = false;
+	mSegments.clear();
+	mPockets.clear();
+
+	//Corner pockets and a pocket halfway along the top and bottom cushions
+	double pocketX[6] = { 0, width/2, width, 0, width/2, width };
+	double pocketY[6] = { 0, 0, 0, height, height, height };
+	for(int i = 0; i < 6; i++){
+		Pocket pocket = { pocketX[i], pocketY[i], pocketRadius };
+		mPockets.push_back(pocket);
+	}
+
+	//Each cushion stops short of the pocket mouths and curls outward into a rounded jaw
+	double mouth = pocketRadius;
+	double jaw = pocketRadius/2;
+	int jawPieces = 4;
+	double horizontal[2][2] = { { mouth, width/2 - mouth }, { width/2 + mouth, width - mouth } };
+	for(int side = 0; side < 2; side++){
+		double y = side == 0 ? 0 : height;
+		double outward = side == 0 ? -1 : 1;
+		for(int piece = 0; piece < 2; piece++){
+			double x1 = horizontal[piece][0], x2 = horizontal[piece][1];
+			Segment cushion = { x1, y, x2, y, true };
+			if(side == 1){
+				cushion.x1 = x2;
+				cushion.x2 = x1;
+			}
+			mSegments.push_back(cushion);
+			addArc(x1, y + outward*jaw, jaw, outward > 0 ? -PI/2 : PI/2, PI, jawPieces);
+			addArc(x2, y + outward*jaw, jaw, outward > 0 ? -PI/2 : PI/2, 0, jawPieces);
+		}
+	}
+	for(int side = 0; side < 2; side++){
+		double x = side == 0 ? 0 : width;
+		double outward = side == 0 ? -1 : 1;
+		Segment cushion = { x, height - mouth, x, mouth, true };
+		if(side == 1){
+			cushion.y1 = mouth;
+			cushion.y2 = height - mouth;
+		}
+		mSegments.push_back(cushion);
+		addArc(x + outward*jaw, mouth, jaw, outward > 0 ? PI : 0, -PI/2, jawPieces);
+		addArc(x + outward*jaw, height - mouth, jaw, outward > 0 ? PI : 0, PI/2, jawPieces);
+	}
+
+	mNodes.clear();
+	buildNode(0, mSegments.size());
+}
+
+void TableGeometry::addArc(double x, double y, double r, double startAngle, double endAngle, int pieces){
+	for(int i = 0; i < pieces; i++){
+		double a1 = startAngle + (endAngle - startAngle)*i/pieces;
+		double a2 = startAngle + (endAngle - startAngle)*(i + 1)/pieces;
+		Segment piece = { x + r*cos(a1), y + r*sin(a1), x + r*cos(a2), y + r*sin(a2), false };
+		mSegments.push_back(piece);
+	}
+}
+
+int TableGeometry::buildNode(int first, int count){
+	Node node;
+	node.left = -1;
+	node.right = -1;
+	node.first = first;
+	node.count = count;
+
+	//Bounds of every segment under this node
+	node.box.minX = node.box.minY = 1e300;
+	node.box.maxX = node.box.maxY = -1e300;
+	for(int i = first; i < first + count; i++){
+		const Segment& seg = mSegments[i];
+		double backX = 0, backY = 0;
+		if(seg.oneSided){
+			//Cover the space behind a cushion too, so escaped balls are still found and pushed back
+			double length = sqrt((seg.x2 - seg.x1)*(seg.x2 - seg.x1) + (seg.y2 - seg.y1)*(seg.y2 - seg.y1));
+			double depth = fmax(mWidth, mHeight);
+			backX = (seg.y2 - seg.y1)/length*depth;
+			backY = -(seg.x2 - seg.x1)/length*depth;
+		}
+		node.box.minX = fmin(node.box.minX, fmin(fmin(seg.x1, seg.x2), fmin(seg.x1, seg.x2) + backX));
+		node.box.minY = fmin(node.box.minY, fmin(fmin(seg.y1, seg.y2), fmin(seg.y1, seg.y2) + backY));
+		node.box.maxX = fmax(node.box.maxX, fmax(fmax(seg.x1, seg.x2), fmax(seg.x1, seg.x2) + backX));
+		node.box.maxY = fmax(node.box.maxY, fmax(fmax(seg.y1, seg.y2), fmax(seg.y1, seg.y2) + backY));
+	}
+
+	int index = mNodes.size();
+	mNodes.push_back(node);
+
+	//Small runs stay as leaves, bigger ones split at the median of the longer axis
+	const int LEAF_SIZE = 2;
+	if(count > LEAF_SIZE){
+		bool splitX = node.box.maxX - node.box.minX >= node.box.maxY - node.box.minY;
+		std::vector<Segment>::iterator begin = mSegments.begin() + first;
+		std::nth_element(begin, begin + count/2, begin + count, [splitX](const Segment& a, const Segment& b){
+			return splitX ? a.x1 + a.x2 < b.x1 + b.x2 : a.y1 + a.y2 < b.y1 + b.y2;
+		});
+		int left = buildNode(first, count/2);
+		int right = buildNode(first + count/2, count - count/2);
+		mNodes[index].left = left;
+		mNodes[index].right = right;
+		mNodes[index].count = 0;
+	}
+	return index;
+}
+
+int TableGeometry::collide(double& x, double& y, double& velX, double& velY, double r){
+	if(mNodes.empty()){
+		return 0;
+	}
+
+	int bounces = 0;
+	int stack[64];
+	int top = 0;
+	stack[top++] = 0;
+	while(top > 0){
+		const Node& node = mNodes[stack[--top]];
+
+		//Skip subtrees whose bounds the ball cannot touch
+		if(x + r < node.box.minX || x - r > node.box.maxX || y + r < node.box.minY || y - r > node.box.maxY){
+			continue;
+		}
+		if(node.count == 0){
+			stack[top++] = node.left;
+			stack[top++] = node.right;
+			continue;
+		}
+
+		for(int i = node.first; i < node.first + node.count; i++){
+			const Segment& seg = mSegments[i];
+
+			//Closest point on the segment to the ball's center
+			double segX = seg.x2 - seg.x1, segY = seg.y2 - seg.y1;
+			double lengthSq = segX*segX + segY*segY;
+			double t = lengthSq > 0 ? ((x - seg.x1)*segX + (y - seg.y1)*segY)/lengthSq : 0;
+			double dist, normalX, normalY;
+			if(seg.oneSided && t >= 0 && t <= 1){
+				//Signed distance, so a ball that ended up behind a cushion is pushed back onto the table
+				double length = sqrt(lengthSq);
+				normalX = -segY/length;
+				normalY = segX/length;
+				dist = (x - seg.x1)*normalX + (y - seg.y1)*normalY;
+				if(dist >= r){
+					continue;
+				}
+			}
+			else{
+				t = fmax(0, fmin(1, t));
+				double dx = x - (seg.x1 + t*segX), dy = y - (seg.y1 + t*segY);
+				dist = sqrt(dx*dx + dy*dy);
+				if(dist >= r || dist == 0){
+					continue;
+				}
+				normalX = dx/dist;
+				normalY = dy/dist;
+			}
+
+			//Push the ball clear and reflect it only if it is still heading in
+			x += normalX*(r - dist);
+			y += normalY*(r - dist);
+			double approach = velX*normalX + velY*normalY;
+			if(approach < 0){
+				gMonitor.addWallImpulse(-2*Ball::BALL_MASS*approach*normalX, -2*Ball::BALL_MASS*approach*normalY);
+				gObservables.addWallImpulse(-2*Ball::BALL_MASS*approach);
+				velX -= 2*approach*normalX;
+				velY -= 2*approach*normalY;
+				bounces++;
+			}
+		}
+	}
+	return bounces;
+}
+
+bool TableGeometry::inPocket(double x, double y){
+	//Anything that slipped past the table edge through a mouth has fallen in too
+	if(x < 0 || y < 0 || x > mWidth || y > mHeight){
+		return true;
+	}
+	for(int i = 0; i < mPockets.size(); i++){
+		double dx = x - mPockets[i].x, dy = y - mPockets[i].y;
+		if(dx*dx + dy*dy < mPockets[i].r*mPockets[i].r){
+			return true;
+		}
+	}
+	return false;
+}
+
+bool TableGeometry::hasPockets(){
+	return !mPockets.empty();
+}
+
+void TableGeometry::buildPeriodic(double width, double height){
+	mWidth = width;
+	mHeight = height;
+	mPeriodic = true;
+	mSegments.clear();
+	mPockets.clear();
+	mNodes.clear();
+}
+
+bool TableGeometry::isPeriodic(){
+	return mPeriodic;
+}
+
+bool TableGeometry::wrap(double& x, double& y){
+	if(!mPeriodic || (x >= 0 && x < mWidth && y >= 0 && y < mHeight)){
+		return false;
+	}
+	x -= mWidth*floor(x/mWidth);
+	y -= mHeight*floor(y/mHeight);
+
+	//Rounding can land a point just below zero exactly on the far edge
+	x = x < mWidth ? x : 0;
+	y = y < mHeight ? y : 0;
+	return true;
+}
+
+void TableGeometry::minimumImage(double& dx, double& dy){
+	if(mPeriodic){
+		dx -= mWidth*nearbyint(dx/mWidth);
+		dy -= mHeight*nearbyint(dy/mHeight);
+	}
+}
+
+#ifndef BOUNCING_BALL_LIBRARY
+void TableGeometry::render(){
+	//The plain box is the window edge and needs no drawing
+	if(mPockets.empty()){
+		return;
+	}
+
+	SDL_SetRenderDrawColor(gRenderer, 0x00, 0x60, 0x00, 0xFF);
+	for(int i = 0; i < mSegments.size(); i++){
+		const Segment& seg = mSegments[i];
+		SDL_RenderDrawLine(gRenderer, seg.x1, seg.y1, seg.x2, seg.y2);
+	}
+
+	//Pocket outlines
+	SDL_SetRenderDrawColor(gRenderer, 0x00, 0x00, 0x00, 0xFF);
+	const int POCKET_PIECES = 24;
+	for(int i = 0; i < mPockets.size(); i++){
+		const Pocket& pocket = mPockets[i];
+		for(int j = 0; j < POCKET_PIECES; j++){
+			double a1 = 2*PI*j/POCKET_PIECES, a2 = 2*PI*(j + 1)/POCKET_PIECES;
+			SDL_RenderDrawLine(gRenderer, pocket.x + pocket.r*cos(a1), pocket.y + pocket.r*sin(a1), pocket.x + pocket.r*cos(a2), pocket.y + pocket.r*sin(a2));
+		}
+	}
+}
+#endif
+
+}
+
+WorldSettings::WorldSettings(){
+	width = SCREEN_WIDTH;
+	height = SCREEN_HEIGHT;
+	table = WORLD_TABLE_BOX;
+	dt = 1.0/60;
+	gravity = 0;
+	substepFraction = 0.5;
+	threads = -1;
+	reorderInterval = 0;
+}
+
+World::World(){
+	mStarted = false;
+}
+
+World::~World(){
+	stop();
+}
+
+bool World::start(const WorldSettings& settings){
+	if(gWorldStarted){
+		printf("Another World is already running in this process!\n");
+		return false;
+	}
+	if(settings.width < 2*Ball::BALL_WIDTH || settings.height < 2*Ball::BALL_HEIGHT){
+		printf("A %.0f x %.0f World is too small for a ball!\n", settings.width, settings.height);
+		return false;
+	}
+	if(settings.dt <= 0 || settings.substepFraction < 0){
+		printf("World step %g and substep fraction %g must be positive!\n", settings.dt, settings.substepFraction);
+		return false;
+	}
+	if(settings.table == WORLD_TABLE_PERIODIC && settings.gravity != 0){
+		printf("Gravity needs a floor, a periodic World cannot have it!\n");
+		return false;
+	}
+
+	//Only the physics settings matter, every output stays off
+	setDefaultSettings();
+	gSettings.billiardTable = settings.table == WORLD_TABLE_BILLIARD;
+	gSettings.periodicTable = settings.table == WORLD_TABLE_PERIODIC;
+	gSettings.dt = settings.dt;
+	gSettings.gravity = settings.gravity;
+	gSettings.substepFraction = settings.substepFraction;
+	if(settings.threads >= 0){
+		gSettings.threads = settings.threads;
+	}
+	gSettings.reorderInterval = settings.reorderInterval;
+
+	gWorldWidth = settings.width;
+	gWorldHeight = settings.height;
+	if(gSettings.billiardTable){
+		gTable.buildBilliard(gWorldWidth, gWorldHeight, Ball::BALL_WIDTH);
+	}
+	else if(gSettings.periodicTable){
+		gTable.buildPeriodic(gWorldWidth, gWorldHeight);
+	}
+	else{
+		gTable.buildBox(gWorldWidth, gWorldHeight);
+	}
+	clearBalls();
+	mHandles.clear();
+	gSteps = 0;
+
+	gThreadPool.start(gSettings.threads, NULL);
+	gReorder.start(gSettings.reorderInterval, gSettings.reorderKey);
+	gWorldStarted = true;
+	mStarted = true;
+	return true;
+}
+
+void World::stop(){
+	if(!mStarted){
+		return;
+	}
+	gThreadPool.stop();
+	clearBalls();
+	mHandles.clear();
+	gWorldStarted = false;
+	mStarted = false;
+}
+
+bool World::setBalls(std::span<const double> x, std::span<const double> y, std::span<const double> velX, std::span<const double> velY){
+	if(!mStarted || y.size() != x.size() || velX.size() != x.size() || velY.size() != x.size()){
+		return false;
+	}
+
+	//Every ball has to start on the table, a periodic one brings them back across the edges
+	double r = Ball::BALL_WIDTH/2;
+	for(size_t i = 0; i < x.size(); i++){
+		bool inside = x[i] >= r && x[i] <= gWorldWidth - r && y[i] >= r && y[i] <= gWorldHeight - r;
+		if(!gTable.isPeriodic() && !inside){
+			printf("Ball %zu at (%.1f, %.1f) is off the %.0f x %.0f table!\n", i, x[i], y[i], gWorldWidth, gWorldHeight);
+			return false;
+		}
+	}
+
+	clearBalls();
+	mHandles.resize(x.size());
+	for(size_t i = 0; i < x.size(); i++){
+		double ballX = x[i], ballY = y[i];
+		if(gTable.isPeriodic()){
+			gTable.wrap(ballX, ballY);
+		}
+		BallHandle handle = spawnBall(Ball(ballX, ballY, velX[i], velY[i]));
+		mHandles[i] = handle.slot | (uint64_t)handle.generation << 32;
+	}
+	gSteps = 0;
+	return true;
+}
+
+bool World::setVelocities(std::span<const double> velX, std::span<const double> velY){
+	if(velX.size() != mHandles.size() || velY.size() != mHandles.size()){
+		return false;
+	}
+	for(size_t i = 0; i < mHandles.size(); i++){
+		BallHandle handle = { (Uint32)mHandles[i], (Uint32)(mHandles[i] >> 32) };
+		int index = gRegistry.indexOf(handle);
+		if(index >= 0){
+			gBalls[index].mVelX = velX[i];
+			gBalls[index].mVelY = velY[i];
+		}
+	}
+	return true;
+}
+
+bool World::getPositions(std::span<double> x, std::span<double> y){
+	if(x.size() < mHandles.size() || y.size() < mHandles.size()){
+		return false;
+	}
+	for(size_t i = 0; i < mHandles.size(); i++){
+		BallHandle handle = { (Uint32)mHandles[i], (Uint32)(mHandles[i] >> 32) };
+		int index = gRegistry.indexOf(handle);
+		x[i] = index >= 0 ? gBalls[index].mPosX : NAN;
+		y[i] = index >= 0 ? gBalls[index].mPosY : NAN;
+	}
+	return true;
+}
 
-        if((i != currentBall)&&(checkCollision(mCollider, gColliders[i]))){
-            calculateNewVel(gBalls[currentBall],gBalls[i]);
-            shiftColliders();
-        }
-        gColliders.at(currentBall) = gBalls[currentBall].getCollider();
+bool World::getVelocities(std::span<double> velX, std::span<double> velY){
+	if(velX.size() < mHandles.size() || velY.size() < mHandles.size()){
+		return false;
 	}
+	for(size_t i = 0; i < mHandles.size(); i++){
+		BallHandle handle = { (Uint32)mHandles[i], (Uint32)(mHandles[i] >> 32) };
+		int index = gRegistry.indexOf(handle);
+		velX[i] = index >= 0 ? gBalls[index].mVelX : NAN;
+		velY[i] = index >= 0 ? gBalls[index].mVelY : NAN;
+	}
+	return true;
 }
 
-//make a return velocity function for
-void Ball::render(){
-    //Show the ball
-	gBallTexture.render(mPosX-mCollider.r, mPosY-mCollider.r);
+size_t World::getCount(){
+	return mHandles.size();
 }
-int Ball::getVelX(){
-    return mVelX;
+
+size_t World::getInPlay(){
+	return gBalls.size();
 }
-int Ball::getVelY(){
-    return mVelY;
+
+void World::step(int n){
+	if(!mStarted){
+		return;
+	}
+	FrameContext frame;
+	for(int i = 0; i < n; i++){
+		stepSimulation(frame, false);
+	}
 }
 
-Circle& Ball::getCollider(){
-	return mCollider;
+uint64_t World::getSteps(){
+	return gSteps;
 }
 
-void Ball::shiftColliders(){
-	//Align collider to center of ball
-	mCollider.x = mPosX;
-	mCollider.y = mPosY;
+double World::getTime(){
+	return gSteps*gSettings.dt;
 }
 
-//bug: Improve on the flexibility of this
+void World::render(WorldRenderer& renderer){
+	//Pocketed balls were already taken out at the end of their step
+	mX.resize(gBalls.size());
+	mY.resize(gBalls.size());
+	mVelX.resize(gBalls.size());
+	mVelY.resize(gBalls.size());
+	mRadius.resize(gBalls.size());
+	for(int i = 0; i < gBalls.size(); i++){
+		mX[i] = gBalls[i].mPosX;
+		mY[i] = gBalls[i].mPosY;
+		mVelX[i] = gBalls[i].mVelX;
+		mVelY[i] = gBalls[i].mVelY;
+		mRadius[i] = gColliders[i].r;
+	}
 
-void loadBalls(int n){
-	//Table-like layout of initial positions of the balls
-	int columnCount = 1;
-	int rowCount = 1;
-	//Offset for the left and right 'walls'
-	int offset = SCREEN_WIDTH/10;
-	int posY = Ball::BALL_WIDTH;
-	int posX = Ball::BALL_HEIGHT;
+	WorldFrame frame;
+	frame.step = gSteps;
+	frame.time = getTime();
+	frame.width = gWorldWidth;
+	frame.height = gWorldHeight;
+	frame.periodic = gTable.isPeriodic();
+	frame.x = mX;
+	frame.y = mY;
+	frame.velX = mVelX;
+	frame.velY = mVelY;
+	frame.radius = mRadius;
+	renderer.draw(frame);
+}
 
+namespace bouncingball{
+
+//Benchmark, regression check and command line belong to the program
+#ifndef BOUNCING_BALL_LIBRARY
+void loadBenchmarkBalls(int n){
+	//One lattice cell per ball, jittered as far as the cell leaves room
+	double cell = sqrt(gWorldWidth*gWorldHeight/n);
+	int columns = std::max(1, (int)(gWorldWidth/cell));
+	double jitter = std::max(0.0, cell - Ball::BALL_WIDTH);
 	for(int i = 0; i < n; i++){
-		posX = columnCount*(Ball::BALL_WIDTH + offset);
-		columnCount++;
-		if(posX > (SCREEN_WIDTH - offset)){
-			rowCount++;
-			posY = rowCount*(Ball::BALL_HEIGHT + offset);
-			columnCount = 1;
-		}
-		Ball ball(posX-50, posY, 4 + rand()%5-4, 4 + rand()%5-3);
-		gBalls.push_back(ball);
-		gColliders.push_back(ball.getCollider());
+		double x = (i % columns)*cell + Ball::BALL_WIDTH/2 + jitter*(rand()/(RAND_MAX + 1.0));
+		double y = (i/columns)*cell + Ball::BALL_HEIGHT/2 + jitter*(rand()/(RAND_MAX + 1.0));
+		double angle = 2*PI*(rand()/(RAND_MAX + 1.0));
+
+		Ball ball(0, 0, 0, 0);
+		BallState state = ball.getState();
+		state.posX = std::min(x, gWorldWidth - Ball::BALL_WIDTH/2);
+		state.posY = std::min(y, gWorldHeight - Ball::BALL_HEIGHT/2);
+		state.velX = gSpawnSpeed*cos(angle);
+		state.velY = gSpawnSpeed*sin(angle);
+		ball.setState(state);
+		spawnBall(ball);
 	}
 }
 
-bool checkCollision(Circle& a, Circle& b){
-	//Calculate total radius squared
-    int totalRadii = a.r + b.r;
+bool runBenchmark(){
+	std::string csvPath = gSettings.benchmarkPrefix + ".csv";
+	FILE* csv = fopen(csvPath.c_str(), "w");
+	if(csv == NULL){
+		printf("Unable to open %s! errno: %d\n", csvPath.c_str(), errno);
+		return false;
+	}
+	fprintf(csv, "balls,density,threads,world_width,world_height,steps,wall_ms,ns_per_ball_step,cycles_per_ball_step,instructions_per_ball_step,ipc,cache_misses_per_ball_step,branch_misses_per_ball_step,reorders,numa\n");
 
-    //If the ditsance between the centers of the circles is less than the sum of their radii
-    if(distance(a.x, a.y, b.x, b.y) < (totalRadii)){
-        //The circles have collided
-        return true;
-    }
-    return false;
-}
+	//Counters are opened before the pool so its threads inherit them
+	PerfCounters counters;
+	if(!counters.open()){
+		printf("Hardware counters unavailable (errno %d), only wall time is recorded\n", errno);
+	}
 
-double distance(int x1, int y1, int x2, int y2){
-	int deltaX = x2 - x1;
-	int deltaY = y2 - y1;
-	return sqrt(pow(deltaX, 2) + pow(deltaY, 2));
+	printf("%10s %8s %7s %14s %8s %14s\n", "balls", "density", "threads", "ns/ball-step", "ipc", "misses/step");
+	for(int t = 0; t < gSettings.benchmarkThreads.size(); t++){
+		int threads = gSettings.benchmarkThreads[t];
+		gThreadPool.start(threads - 1, gSettings.numaLocal ? &gNuma : NULL);
+		for(int d = 0; d < gSettings.benchmarkDensities.size(); d++){
+			double density = gSettings.benchmarkDensities[d];
+			for(int s = 0; s < gSettings.benchmarkSizes.size(); s++){
+				int n = gSettings.benchmarkSizes[s];
+
+				//Size the world so the balls cover the requested fraction of it
+				double area = n*PI*(Ball::BALL_WIDTH/2)*(Ball::BALL_WIDTH/2)/density;
+				gWorldWidth = std::max(4.0*Ball::BALL_WIDTH, sqrt(area*SCREEN_WIDTH/SCREEN_HEIGHT));
+				gWorldHeight = std::max(4.0*Ball::BALL_HEIGHT, area/gWorldWidth);
+				if(gSettings.billiardTable){
+					gTable.buildBilliard(gWorldWidth, gWorldHeight, Ball::BALL_WIDTH);
+				}
+				else if(gSettings.periodicTable){
+					gTable.buildPeriodic(gWorldWidth, gWorldHeight);
+				}
+				else{
+					gTable.buildBox(gWorldWidth, gWorldHeight);
+				}
+				srand(1);
+				clearBalls();
+				loadBenchmarkBalls(n);
+				nudgeBallLoop();
+				gReorder.start(gSettings.reorderInterval, gSettings.reorderKey);
+
+				//One untimed step settles the first contacts and warms the caches
+				FrameContext frame;
+				stepSimulation(frame, false);
+
+				int steps = std::max(3, std::min(1000, (int)(gSettings.benchmarkWork/n)));
+				counters.start();
+				std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+				for(int i = 0; i < steps; i++){
+					stepSimulation(frame, false);
+				}
+				double wallMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+				counters.stop();
+
+				//Everything per ball-step so sizes can be compared, blank where a counter is missing
+				double ballSteps = (double)n*steps;
+				long long values[PerfCounters::COUNTER_TOTAL];
+				std::string perBall[PerfCounters::COUNTER_TOTAL];
+				for(int c = 0; c < PerfCounters::COUNTER_TOTAL; c++){
+					values[c] = counters.read((PerfCounters::Counter)c);
+					if(values[c] >= 0){
+						char text[32];
+						snprintf(text, sizeof(text), "%.2f", values[c]/ballSteps);
+						perBall[c] = text;
+					}
+				}
+				std::string ipc;
+				if(values[PerfCounters::CYCLES] > 0 && values[PerfCounters::INSTRUCTIONS] >= 0){
+					char text[32];
+					snprintf(text, sizeof(text), "%.3f", (double)values[PerfCounters::INSTRUCTIONS]/values[PerfCounters::CYCLES]);
+					ipc = text;
+				}
+				double nsPerBallStep = wallMs*1e6/ballSteps;
+				fprintf(csv, "%d,%g,%d,%.0f,%.0f,%d,%.3f,%.2f,%s,%s,%s,%s,%s,%d,%s\n", n, density, threads, gWorldWidth, gWorldHeight, steps, wallMs, nsPerBallStep,
+					perBall[PerfCounters::CYCLES].c_str(), perBall[PerfCounters::INSTRUCTIONS].c_str(), ipc.c_str(), perBall[PerfCounters::CACHE_MISSES].c_str(), perBall[PerfCounters::BRANCH_MISSES].c_str(), gReorder.getReorders(), gSettings.numaLocal ? "local" : "flat");
+				fflush(csv);
+				printf("%10d %8g %7d %14.1f %8s %14s\n", n, density, threads, nsPerBallStep, ipc.empty() ? "-" : ipc.c_str(), perBall[PerfCounters::CACHE_MISSES].empty() ? "-" : perBall[PerfCounters::CACHE_MISSES].c_str());
+			}
+		}
+		gThreadPool.stop();
+	}
+	fclose(csv);
+	clearBalls();
+
+	//Gnuplot script with one line per density and thread count, log-log like the sweep
+	std::string plotPath = gSettings.benchmarkPrefix + ".gp";
+	FILE* plot = fopen(plotPath.c_str(), "w");
+	if(plot == NULL){
+		printf("Unable to open %s! errno: %d\n", plotPath.c_str(), errno);
+		return false;
+	}
+	fprintf(plot, "set datafile separator ','\n");
+	fprintf(plot, "set terminal pngcairo size 1200,500\n");
+	fprintf(plot, "set output '%s.png'\n", gSettings.benchmarkPrefix.c_str());
+	fprintf(plot, "set multiplot layout 1,2\n");
+	fprintf(plot, "set logscale x\nset xlabel 'balls'\nset key left top\n");
+	const char* panels[2][2] = { {"ns per ball-step", "8"}, {"cache misses per ball-step", "12"} };
+	for(int p = 0; p < 2; p++){
+		fprintf(plot, "set ylabel '%s'\nplot", panels[p][0]);
+		for(int t = 0; t < gSettings.benchmarkThreads.size(); t++){
+			for(int d = 0; d < gSettings.benchmarkDensities.size(); d++){
+				fprintf(plot, "%s '%s' every ::1 using 1:(($2 == %g && $3 == %d) ? $%s : 1/0) with linespoints title 'density %g, %d threads'",
+					t + d > 0 ? "," : "", csvPath.c_str(), gSettings.benchmarkDensities[d], gSettings.benchmarkThreads[t], panels[p][1], gSettings.benchmarkDensities[d], gSettings.benchmarkThreads[t]);
+			}
+		}
+		fprintf(plot, "\n");
+	}
+	fprintf(plot, "unset multiplot\n");
+	fclose(plot);
+	printf("Wrote %s and %s, plot with gnuplot %s\n", csvPath.c_str(), plotPath.c_str(), plotPath.c_str());
+	return true;
 }
 
-void calculateNewVel(Ball& curBall, Ball& otherBall){
-    int mass = 1;
-    //velocity of current Ball
-    int oldVelXC = curBall.mVelX;
-    int oldVelYC = curBall.mVelY;
-    //velocity of other ball
-    int oldVelXO = otherBall.mVelX;
-    int oldVelYO = otherBall.mVelY;
-
-    int newVelXC = (2*mass*oldVelXO)/(2*mass);
-    int newVelYC = (2*mass*oldVelYO)/(2*mass);
-    int newVelXO = (2*mass*oldVelXC)/(2*mass);
-    int newVelYO = (2*mass*oldVelYC)/(2*mass);
+Uint64 hashBalls(){
+	Uint64 hash = 14695981039346656037ULL;
+	std::vector<double> fields;
+	fields.reserve(4*gBalls.size() + 1);
+	fields.push_back(gBalls.size());
+	for(int i = 0; i < gBalls.size(); i++){
+		BallState state = gBalls[i].getState();
+		fields.push_back(state.posX);
+		fields.push_back(state.posY);
+		fields.push_back(state.velX);
+		fields.push_back(state.velY);
+	}
 
-    curBall.mVelX = newVelXC;
-    curBall.mVelY = newVelYC;
-    otherBall.mVelX = newVelXO;
-    otherBall.mVelY = newVelYO;
+	//Bit patterns are hashed, so a change in the last place of any ball counts as a divergence
+	const unsigned char* bytes = (const unsigned char*)&fields[0];
+	for(int i = 0; i < fields.size()*sizeof(double); i++){
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
 }
 
-void nudgeBallMath(Circle& curBall, Circle& otherBall){
-    //distance to be moved
-    double dist = distance(curBall.x,curBall.y,otherBall.x,otherBall.y);
-    double x =((2*curBall.r-dist))/2;
-    double newXposC = ((curBall.x-otherBall.x)/dist)*x;
-    double newYposC = ((curBall.y-otherBall.y)/dist)*x;
-    double newXposO = ((otherBall.x-curBall.x)/dist)*x;
-    double newYposO = ((otherBall.y-curBall.x)/dist)*x;
+bool runRegression(){
+	//Canonical scenes, each covers a different part of the physics
+	struct Scene{
+		const char* name;
+		int balls;
+		double density;
+		bool billiard;
+		bool periodic;
+		double gravity;
+		double dt;
+	};
+	const Scene scenes[] = {
+		{"gas", 2000, 0.05, false, false, 0, 1.0/60},
+		{"dense", 5000, 0.5, false, false, 0, 1.0/60},
+		{"billiard", 1000, 0.2, true, false, 0, 1.0/60},
+		{"gravity", 2000, 0.3, false, false, 500, 1.0/60},
+		{"large-dt", 2000, 0.2, false, false, 0, 0.05},
+		{"periodic", 2000, 0.3, false, true, 0, 1.0/60}
+	};
+	const int SCENE_COUNT = sizeof(scenes)/sizeof(scenes[0]);
+	const int STEPS = 600;
+	const int CHECKPOINT = 100;
+
+	//Golden lines are "hash scene step value" and "time scene ns-per-step"
+	struct Record{
+		std::string kind, scene;
+		int step;
+		std::string value;
+	};
+	std::vector<Record> golden;
+	FILE* file = gSettings.regressUpdate ? NULL : fopen(gSettings.regressPath.c_str(), "r");
+	if(!gSettings.regressUpdate && file == NULL){
+		printf("Unable to open %s! errno: %d (run with --regress-update to create it)\n", gSettings.regressPath.c_str(), errno);
+		return false;
+	}
+	if(file != NULL){
+		char line[256];
+		while(fgets(line, sizeof(line), file) != NULL){
+			char kind[16], scene[64], value[64];
+			int step = 0;
+			if(line[0] == '#'){
+				continue;
+			}
+			if(sscanf(line, "hash %63s %d %63s", scene, &step, value) == 3){
+				Record record = {"hash", scene, step, value};
+				golden.push_back(record);
+			}
+			else if(sscanf(line, "%15s %63s %63s", kind, scene, value) == 3 && std::string(kind) == "time"){
+				Record record = {"time", scene, 0, value};
+				golden.push_back(record);
+			}
+		}
+		fclose(file);
+	}
 
-    curBall.x = newXposC;
-    curBall.y = newYposC;
-    otherBall.x = newXposO;
-    otherBall.y = newYposO;
+	//Looks up a golden value, empty when the file has none
+	auto lookup = [&golden](const std::string& kind, const std::string& scene, int step){
+		for(int i = 0; i < golden.size(); i++){
+			if(golden[i].kind == kind && golden[i].scene == scene && golden[i].step == step){
+				return golden[i].value;
+			}
+		}
+		return std::string();
+	};
+
+	//Physics settings the scenes change, put back afterwards
+	Settings saved = gSettings;
+
+	//Lays a scene out on its table and starts the reorder pass and a pool of this many helpers for it
+	auto setUp = [&](const Scene& scene, int threads){
+		gSettings.billiardTable = scene.billiard;
+		gSettings.periodicTable = scene.periodic;
+		gSettings.gravity = scene.gravity;
+		gSettings.dt = scene.dt;
+		gSettings.substepFraction = 0.5;
+
+		double area = scene.balls*PI*(Ball::BALL_WIDTH/2)*(Ball::BALL_WIDTH/2)/scene.density;
+		gWorldWidth = std::max(4.0*Ball::BALL_WIDTH, sqrt(area*SCREEN_WIDTH/SCREEN_HEIGHT));
+		gWorldHeight = std::max(4.0*Ball::BALL_HEIGHT, area/gWorldWidth);
+		if(scene.billiard){
+			gTable.buildBilliard(gWorldWidth, gWorldHeight, Ball::BALL_WIDTH);
+		}
+		else if(scene.periodic){
+			gTable.buildPeriodic(gWorldWidth, gWorldHeight);
+		}
+		else{
+			gTable.buildBox(gWorldWidth, gWorldHeight);
+		}
+		srand(1);
+		clearBalls();
+		loadBenchmarkBalls(scene.balls);
+		nudgeBallLoop();
+
+		//A fixed interval keeps the ball order, and with it the contact order, the same on every machine
+		gReorder.start(CHECKPOINT/2, SpatialReorder::KEY_CELLS);
+
+		//Each scene gets the pool restarted, so a pool that misbehaves after a restart shows up as a divergence
+		gThreadPool.start(threads, gSettings.numaLocal ? &gNuma : NULL);
+	};
+
+	std::vector<Record> results;
+	int divergences = 0, slowdowns = 0;
+	printf("%-10s %12s %12s %8s  %s\n", "scene", "ns/step", "baseline", "change", "hashes");
+	for(int s = 0; s < SCENE_COUNT; s++){
+		const Scene& scene = scenes[s];
+		setUp(scene, gSettings.threads);
+
+		FrameContext frame;
+		double stepMs = 0;
+		bool diverged = false;
+		std::string hashes;
+		for(int step = 1; step <= STEPS; step++){
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			stepSimulation(frame, false);
+			stepMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+			if(step % CHECKPOINT != 0){
+				continue;
+			}
+			char value[32];
+			snprintf(value, sizeof(value), "%016llx", (unsigned long long)hashBalls());
+			Record record = {"hash", scene.name, step, value};
+			results.push_back(record);
+
+			std::string expected = lookup("hash", scene.name, step);
+			if(gSettings.regressUpdate){
+				hashes += "+";
+			}
+			else if(expected == value){
+				hashes += ".";
+			}
+			else{
+				hashes += "X";
+				if(!diverged){
+					printf("DIVERGED: %s at step %d, hash %s, golden %s\n", scene.name, step, value, expected.empty() ? "missing" : expected.c_str());
+				}
+				diverged = true;
+			}
+		}
+		divergences += diverged;
+
+		//Step time against the baseline. Times from another machine mean nothing, so only --regress-timing fails on a slowdown
+		double nsPerStep = stepMs*1e6/STEPS;
+		char value[32];
+		snprintf(value, sizeof(value), "%.0f", nsPerStep);
+		Record record = {"time", scene.name, 0, value};
+		results.push_back(record);
+		std::string baseline = lookup("time", scene.name, 0);
+		double baselineNs = atof(baseline.c_str());
+		std::string change = "-";
+		if(!gSettings.regressUpdate && baselineNs > 0){
+			char text[32];
+			snprintf(text, sizeof(text), "%+.1f%%", 100*(nsPerStep/baselineNs - 1));
+			change = text;
+			if(gSettings.regressTiming && nsPerStep > baselineNs*(1 + gSettings.regressTolerance)){
+				printf("SLOWER: %s takes %.0f ns/step, baseline %.0f ns/step allows %.0f\n", scene.name, nsPerStep, baselineNs, baselineNs*(1 + gSettings.regressTolerance));
+				slowdowns++;
+			}
+		}
+		printf("%-10s %12.0f %12s %8s  %s\n", scene.name, nsPerStep, baseline.empty() ? "-" : baseline.c_str(), change.c_str(), hashes.c_str());
+		gThreadPool.stop();
+	}
 
-}
-void nudgeBallLoop(){
-    for(int i = 0; i<gColliders.size();i++){
-        int currentBall = i;
-        for(int j = 0; j<gColliders.size();j++){
-            if((j != currentBall)&&(checkCollision(gColliders[currentBall], gColliders[j]))){
-                nudgeBallMath(gColliders[currentBall],gColliders[j]);
-            }
-        }
-    }
-}
-LTimer::LTimer(){
-    //Initialize the variables
-    mStartTicks = 0;
-    mPausedTicks = 0;
+	//The renderer shares the pool with physics from another thread. Step the dense scene again while a second thread
+	//keeps drawing its first step with the software backend, the hashes must still match and every frame the first.
+	//Loops without helpers never share anything, so this runs with at least two even on one CPU
+	bool renderFailed = false;
+	if(!gSettings.regressUpdate){
+		const Scene& scene = scenes[1];
+		setUp(scene, std::max(2, gSettings.threads));
+		RenderSnapshot snapshot;
+		snapshot.pack(gBalls, gRegistry, gWorldWidth, gWorldHeight, false, scene.periodic);
+		BallSprite sprite;
+		TileRenderer renderer;
+		sprite.create(Ball::BALL_WIDTH);
+		renderer.start(TileRenderer::BACKEND_SOFTWARE, SCREEN_WIDTH, SCREEN_HEIGHT);
+
+		auto drawFrame = [&](){
+			renderer.render(snapshot, gThreadPool, sprite);
+			Uint64 hash = 14695981039346656037ULL;
+			const Uint32* pixels = renderer.getPixels();
+			for(int i = 0; i < SCREEN_WIDTH*SCREEN_HEIGHT; i++){
+				hash ^= pixels[i];
+				hash *= 1099511628211ULL;
+			}
+			return hash;
+		};
+		Uint64 firstFrame = drawFrame();
+		std::atomic<bool> stepping(true);
+		std::atomic<int> frames(0), wrongFrames(0);
+		std::thread drawer([&](){
+			while(stepping){
+				wrongFrames += drawFrame() != firstFrame;
+				frames++;
+			}
+		});
+
+		FrameContext frame;
+		std::string hashes;
+		for(int step = 1; step <= STEPS; step++){
+			stepSimulation(frame, false);
+			if(step % CHECKPOINT != 0){
+				continue;
+			}
+			char value[32];
+			snprintf(value, sizeof(value), "%016llx", (unsigned long long)hashBalls());
+			bool match = lookup("hash", scene.name, step) == value;
+			hashes += match ? "." : "X";
+			renderFailed = renderFailed || !match;
+		}
+		stepping = false;
+		drawer.join();
+		if(wrongFrames > 0){
+			printf("DIVERGED: %d of %d software frames drawn beside %s came out different\n", (int)wrongFrames, (int)frames, scene.name);
+			renderFailed = true;
+		}
+		printf("%-10s %12s %12s %8s  %s  %d frames drawn alongside\n", "+render", "-", "-", "-", hashes.c_str(), (int)frames);
+		gThreadPool.stop();
+	}
+	clearBalls();
+	gSettings = saved;
+
+	if(gSettings.regressUpdate){
+		file = fopen(gSettings.regressPath.c_str(), "w");
+		if(file == NULL){
+			printf("Unable to open %s! errno: %d\n", gSettings.regressPath.c_str(), errno);
+			return false;
+		}
+		fprintf(file, "#Golden state hashes every %d steps and ns per step of the regression scenes, written by --regress-update\n", CHECKPOINT);
+		for(int i = 0; i < results.size(); i++){
+			if(results[i].kind == "hash"){
+				fprintf(file, "hash %s %d %s\n", results[i].scene.c_str(), results[i].step, results[i].value.c_str());
+			}
+			else{
+				fprintf(file, "time %s %s\n", results[i].scene.c_str(), results[i].value.c_str());
+			}
+		}
+		fclose(file);
+		printf("Wrote %s\n", gSettings.regressPath.c_str());
+		return true;
+	}
 
-    mPaused = false;
-    mStarted = false;
+	if(divergences > 0 || slowdowns > 0 || renderFailed){
+		printf("REGRESSION FAILED: %d of %d scenes diverged", divergences, SCENE_COUNT);
+		if(renderFailed){
+			printf(", stepping beside the renderer did not match");
+		}
+		if(gSettings.regressTiming){
+			printf(", %d slower than the baseline by more than %.0f%%", slowdowns, 100*gSettings.regressTolerance);
+		}
+		printf("\n");
+		return false;
+	}
+	printf("Regression check passed\n");
+	return true;
 }
 
-void LTimer::start(){
-    //Start the timer
-    mStarted = true;
-
-    //Unpause the timer
-    mPaused = false;
+template <typename T>
+bool parseList(const char* text, std::vector<T>& values){
+	values.clear();
+	std::stringstream stream(text);
+	std::string item;
+	while(std::getline(stream, item, ',')){
+		std::stringstream number(item);
+		T value;
+		if(!(number >> value) || value <= 0){
+			printf("Bad list entry '%s' in %s\n", item.c_str(), text);
+			return false;
+		}
+		values.push_back(value);
+	}
+	return !values.empty();
+}
+#endif
 
-    //Get the current clock time
-    mStartTicks = SDL_GetTicks();
-	mPausedTicks = 0;
+void setDefaultSettings(){
+	gSettings.captureFormat = FrameCapture::FORMAT_Y4M;
+	gSettings.capturePolicy = FrameCapture::DROP_FRAMES;
+	gSettings.captureBuffers = 8;
+	gSettings.domains = 0;
+	gSettings.telemetrySteps = 16384;
+	gSettings.monitor = false;
+	gSettings.monitorTolerance = 0.01;
+	gSettings.observablesEvery = 60;
+	gSettings.substepFraction = 0.5;
+	gSettings.dt = 1.0/60;
+	gSettings.gravity = 0;
+	gSettings.billiardTable = false;
+	gSettings.periodicTable = false;
+	gSettings.spawnRate = 50;
+	gSettings.shareCapacity = 65536;
+	gSettings.renderer = TileRenderer::BACKEND_SPRITES;
+	//Counted without SDL, which the library build does not link
+	int cpus = std::thread::hardware_concurrency();
+	gSettings.threads = std::max(0, cpus - 1);
+	gSettings.numaLocal = false;
+	gSettings.fastForward = false;
+	gSettings.fastForwardSteps = 0;
+	gSettings.presentRate = 30;
+	gSettings.reorderInterval = 0;
+	gSettings.reorderKey = SpatialReorder::KEY_CELLS;
+	gSettings.benchmarkSizes = {50, 1000, 10000, 100000, 1000000, 10000000};
+	gSettings.benchmarkDensities = {0.05, 0.2, 0.5};
+	gSettings.benchmarkThreads = {1};
+	if(cpus > 1){
+		gSettings.benchmarkThreads.push_back(cpus);
+	}
+	gSettings.benchmarkWork = 2e7;
+	gSettings.regressUpdate = false;
+	gSettings.regressTiming = false;
+	gSettings.regressTolerance = 0.25;
+	gSettings.ensembleSteps = 3600;
+	gSettings.ensembleOutput = "ensemble.csv";
 }
 
-void LTimer::stop(){
-    //Stop the timer
-    mStarted = false;
+#ifndef BOUNCING_BALL_LIBRARY
+bool parseArgs(int argc, char* args[]){
+	setDefaultSettings();
 
-    //Unpause the timer
-    mPaused = false;
+	for(int i = 1; i < argc; i++){
+		std::string arg = args[i];
+		bool hasValue = i + 1 < argc;
 
-	//Clear tick variables
-	mStartTicks = 0;
-	mPausedTicks = 0;
-}
+		if(arg == "--capture" && hasValue){
+			gSettings.capturePath = args[++i];
+		}
+		else if(arg == "--capture-format" && hasValue){
+			std::string value = args[++i];
+			if(value == "y4m"){
+				gSettings.captureFormat = FrameCapture::FORMAT_Y4M;
+			}
+			else if(value == "raw"){
+				gSettings.captureFormat = FrameCapture::FORMAT_RAW;
+			}
+			else{
+				printf("Unknown capture format %s (use y4m or raw)\n", value.c_str());
+				return false;
+			}
+		}
+		else if(arg == "--capture-policy" && hasValue){
+			std::string value = args[++i];
+			if(value == "drop"){
+				gSettings.capturePolicy = FrameCapture::DROP_FRAMES;
+			}
+			else if(value == "block"){
+				gSettings.capturePolicy = FrameCapture::BACKPRESSURE;
+			}
+			else{
+				printf("Unknown capture policy %s (use drop or block)\n", value.c_str());
+				return false;
+			}
+		}
+		else if(arg == "--capture-buffers" && hasValue){
+			gSettings.captureBuffers = atoi(args[++i]);
+		}
+		else if(arg == "--telemetry" && hasValue){
+			gSettings.telemetryPrefix = args[++i];
+		}
+		else if(arg == "--telemetry-steps" && hasValue){
+			gSettings.telemetrySteps = atoi(args[++i]);
+		}
+		else if(arg == "--monitor"){
+			gSettings.monitor = true;
+		}
+		else if(arg == "--monitor-tolerance" && hasValue){
+			gSettings.monitor = true;
+			gSettings.monitorTolerance = atof(args[++i]);
+		}
+		else if(arg == "--observables" && hasValue){
+			gSettings.observablesPrefix = args[++i];
+		}
+		else if(arg == "--observables-every" && hasValue){
+			gSettings.observablesEvery = atoi(args[++i]);
+			if(gSettings.observablesEvery <= 0){
+				printf("Observables cadence must be at least one step\n");
+				return false;
+			}
+		}
+		else if(arg == "--substep-fraction" && hasValue){
+			gSettings.substepFraction = atof(args[++i]);
+		}
+		else if(arg == "--dt" && hasValue){
+			gSettings.dt = atof(args[++i]);
+			if(gSettings.dt <= 0){
+				printf("Time step must be above zero\n");
+				return false;
+			}
+		}
+		else if(arg == "--gravity" && hasValue){
+			gSettings.gravity = atof(args[++i]);
+		}
+		else if(arg == "--table" && hasValue){
+			std::string value = args[++i];
+			if(value == "box"){
+				gSettings.billiardTable = false;
+				gSettings.periodicTable = false;
+			}
+			else if(value == "billiard"){
+				gSettings.billiardTable = true;
+				gSettings.periodicTable = false;
+			}
+			else if(value == "periodic"){
+				gSettings.billiardTable = false;
+				gSettings.periodicTable = true;
+			}
+			else{
+				printf("Unknown table %s (use box, billiard or periodic)\n", value.c_str());
+				return false;
+			}
+		}
+		else if(arg == "--renderer" && hasValue){
+			std::string value = args[++i];
+			if(value == "sprites"){
+				gSettings.renderer = TileRenderer::BACKEND_SPRITES;
+			}
+			else if(value == "geometry"){
+				gSettings.renderer = TileRenderer::BACKEND_GEOMETRY;
+			}
+			else if(value == "software"){
+				gSettings.renderer = TileRenderer::BACKEND_SOFTWARE;
+			}
+			else{
+				printf("Unknown renderer %s (use sprites, geometry or software)\n", value.c_str());
+				return false;
+			}
+		}
+		else if(arg == "--fast-forward" && hasValue){
+			//A step count presents every k-th step, otherwise the wall-clock rate applies
+			gSettings.fastForward = true;
+			gSettings.fastForwardSteps = atoi(args[++i]);
+			gSettings.presentRate = 0;
+			if(gSettings.fastForwardSteps < 1){
+				printf("Fast-forward needs at least one step per frame\n");
+				return false;
+			}
+		}
+		else if(arg == "--present-rate" && hasValue){
+			gSettings.fastForward = true;
+			gSettings.presentRate = atof(args[++i]);
+			if(gSettings.presentRate <= 0){
+				printf("Present rate must be above zero\n");
+				return false;
+			}
+		}
+		else if(arg == "--benchmark" && hasValue){
+			gSettings.benchmarkPrefix = args[++i];
+		}
+		else if(arg == "--benchmark-sizes" && hasValue){
+			if(!parseList(args[++i], gSettings.benchmarkSizes)){
+				return false;
+			}
+		}
+		else if(arg == "--benchmark-densities" && hasValue){
+			if(!parseList(args[++i], gSettings.benchmarkDensities)){
+				return false;
+			}
 
-Uint32 LTimer::getTicks(){
-	//The actual timer time
-	Uint32 time = 0;
+			//Past square packing the lattice cells are smaller than a ball
+			if(*std::max_element(gSettings.benchmarkDensities.begin(), gSettings.benchmarkDensities.end()) > PI/4){
+				printf("Benchmark densities must be at most %.3f\n", PI/4);
+				return false;
+			}
+		}
+		else if(arg == "--benchmark-threads" && hasValue){
+			if(!parseList(args[++i], gSettings.benchmarkThreads)){
+				return false;
+			}
+		}
+		else if(arg == "--benchmark-work" && hasValue){
+			gSettings.benchmarkWork = atof(args[++i]);
+		}
+		else if(arg == "--regress" && hasValue){
+			gSettings.regressPath = args[++i];
+		}
+		else if(arg == "--regress-update"){
+			gSettings.regressUpdate = true;
+		}
+		else if(arg == "--regress-timing"){
+			gSettings.regressTiming = true;
+		}
+		else if(arg == "--regress-tolerance" && hasValue){
+			gSettings.regressTolerance = atof(args[++i]);
+			if(gSettings.regressTolerance < 0){
+				printf("Regression tolerance must not be negative\n");
+				return false;
+			}
+		}
+		else if(arg == "--ensemble" && hasValue){
+			gSettings.ensemblePath = args[++i];
+		}
+		else if(arg == "--ensemble-steps" && hasValue){
+			gSettings.ensembleSteps = atoi(args[++i]);
+			if(gSettings.ensembleSteps <= 0){
+				printf("Ensemble steps must be above zero\n");
+				return false;
+			}
+		}
+		else if(arg == "--ensemble-output" && hasValue){
+			gSettings.ensembleOutput = args[++i];
+		}
+		else if(arg == "--reorder" && hasValue){
+			std::string value = args[++i];
+			if(value == "auto"){
+				gSettings.reorderInterval = 0;
+			}
+			else if(value == "off"){
+				gSettings.reorderInterval = -1;
+			}
+			else if(atoi(value.c_str()) > 0){
+				gSettings.reorderInterval = atoi(value.c_str());
+			}
+			else{
+				printf("Unknown reorder interval %s (use auto, off or a step count)\n", value.c_str());
+				return false;
+			}
+		}
+		else if(arg == "--reorder-key" && hasValue){
+			std::string value = args[++i];
+			if(value == "cells"){
+				gSettings.reorderKey = SpatialReorder::KEY_CELLS;
+			}
+			else if(value == "morton"){
+				gSettings.reorderKey = SpatialReorder::KEY_MORTON;
+			}
+			else{
+				printf("Unknown reorder key %s (use cells or morton)\n", value.c_str());
+				return false;
+			}
+		}
+		else if(arg == "--threads" && hasValue){
+			gSettings.threads = std::max(0, atoi(args[++i]));
+		}
+		else if(arg == "--numa" && hasValue){
+			std::string value = args[++i];
+			if(value == "flat"){
+				gSettings.numaLocal = false;
+			}
+			else if(value == "local"){
+				gSettings.numaLocal = true;
+			}
+			else{
+				printf("Unknown NUMA layout %s (use flat or local)\n", value.c_str());
+				return false;
+			}
+		}
+		else if(arg == "--record" && hasValue){
+			gSettings.recordPath = args[++i];
+		}
+		else if(arg == "--share"){
+			//The name is optional, POSIX wants it to start with a slash
+			gSettings.shareName = SHARED_STATE_DEFAULT_NAME;
+			if(hasValue && args[i + 1][0] != '-'){
+				gSettings.shareName = args[++i];
+				if(gSettings.shareName[0] != '/'){
+					gSettings.shareName = "/" + gSettings.shareName;
+				}
+			}
+		}
+		else if(arg == "--share-capacity" && hasValue){
+			gSettings.shareCapacity = atoi(args[++i]);
+			if(gSettings.shareCapacity <= 0){
+				printf("Shared memory capacity must be above zero\n");
+				return false;
+			}
+		}
+		else if(arg == "--spawn-rate" && hasValue){
+			gSettings.spawnRate = atoi(args[++i]);
+		}
+		else if(arg == "--domains" && hasValue){
+			gSettings.domains = atoi(args[++i]);
+			if(gSettings.domains < 0 || gSettings.domains > gWorldWidth / (4*Ball::BALL_WIDTH)){
+				printf("Domain count must be between 0 and %d\n", (int)(gWorldWidth / (4*Ball::BALL_WIDTH)));
+				return false;
+			}
+		}
+		else{
+			printf("Unknown option %s\n", arg.c_str());
+			printf("Usage: %s [--capture file] [--capture-format y4m|raw] [--capture-policy drop|block] [--capture-buffers n] [--domains n] [--telemetry prefix] [--telemetry-steps n] [--monitor] [--monitor-tolerance t] [--observables prefix] [--observables-every n] [--substep-fraction f] [--dt seconds] [--gravity g] [--table box|billiard|periodic] [--spawn-rate n] [--record file] [--share [name]] [--share-capacity n] [--renderer sprites|geometry|software] [--threads n] [--numa flat|local] [--reorder auto|off|n] [--reorder-key cells|morton] [--fast-forward k] [--present-rate hz] [--benchmark prefix] [--benchmark-sizes n,...] [--benchmark-densities d,...] [--benchmark-threads t,...] [--benchmark-work n] [--regress file] [--regress-update] [--regress-timing] [--regress-tolerance t] [--ensemble file] [--ensemble-steps n] [--ensemble-output file]\n", args[0]);
+			return false;
+		}
+	}
 
-    //If the timer is running
-    if(mStarted){
-        //If the timer is paused
-        if(mPaused){
-            //Return the number of ticks when the timer was paused
-            time = mPausedTicks;
-        }
-        else{
-            //Return the current time minus the start time
-            time = SDL_GetTicks() - mStartTicks;
-        }
-    }
-    return time;
+	//Wrapping vertically, a falling ball would never land and would speed up for ever
+	if(gSettings.periodicTable && gSettings.gravity != 0){
+		printf("Gravity needs a floor, --table periodic has none\n");
+		return false;
+	}
+	return true;
 }
 
 bool init(){
@@ -640,18 +7219,6 @@ bool init(){
 			else{
 				//Initialize renderer color
 				SDL_SetRenderDrawColor(gRenderer, 0xFF, 0xFF, 0xFF, 0xFF);
-
-				//Initialize PNG loading
-				int imgFlags = IMG_INIT_PNG;
-				if(!(IMG_Init(imgFlags) & imgFlags)){
-					printf( "SDL_image could not initialize! SDL_image Error: %s\n", IMG_GetError() );
-					success = false;
-				}
-				//Initialize SDL_ttf
-				if(TTF_Init() == -1){
-					printf( "SDL_ttf could not initialize! SDL_ttf Error: %s\n", TTF_GetError() );
-					success = false;
-				}
 			}
 		}
 	}
@@ -663,15 +7230,9 @@ bool loadMedia(){
 	//Loading success flag
 	bool success = true;
 
-	//Load ball texture
-	if(!gBallTexture.loadFromFile("ball.bmp")){
-		printf("Failed to load ball texture!\n");
-		success = false;
-	}
-
-	gFont = TTF_OpenFont("consola.ttf", 15);
-	if(gFont == NULL){
-		printf("Failed to load lazy font! SDL_ttf Error: %s\n", TTF_GetError());
+	//Draw the ball sprite, nothing is read from disk
+	if(!gBallSprite.create(Ball::BALL_WIDTH)){
+		printf("Failed to create ball sprite!\n");
 		success = false;
 	}
 
@@ -681,12 +7242,11 @@ bool loadMedia(){
 
 void close(){
 	//Free loaded images
-	gBallTexture.free();
+	gBallSprite.free();
 	gFPSTextTexture.free();
 
 	//Free global font
-	TTF_CloseFont( gFont );
-	gFont = NULL;
+	gFont.close();
 
 	//Destroy window
 	SDL_DestroyRenderer(gRenderer);
@@ -695,8 +7255,8 @@ void close(){
 	gRenderer = NULL;
 
 	//Quit SDL subsystems
-	IMG_Quit();
 	SDL_Quit();
 }
+#endif
 
-
+}
@@ -0,0 +1,76 @@
+//Layout of the shared memory segment BouncingBall publishes with --share, included by the simulation and by readers
+
+#ifndef SHARED_STATE_H
+#define SHARED_STATE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+//"BBSS" and the layout version, readers refuse a segment that does not match both
+const uint32_t SHARED_STATE_MAGIC = 0x53534242;
+const uint32_t SHARED_STATE_VERSION = 1;
+
+//Segment name used when --share is given without one
+#define SHARED_STATE_DEFAULT_NAME "/bouncingBall"
+
+//Position in pixels and velocity in pixels per second of one ball
+struct SharedBall{
+	double x, y;
+	double velX, velY;
+};
+
+//One of the two step buffers, the balls follow it
+struct SharedBuffer{
+	//Seqlock counter, odd while the writer is filling the buffer
+	std::atomic<uint64_t> sequence;
+
+	//Step number and simulated time of the balls in the buffer
+	uint64_t step;
+	double time;
+	uint32_t count;
+	uint32_t padding;
+};
+
+//Start of the segment
+struct SharedStateHeader{
+	uint32_t magic;
+	uint32_t version;
+
+	//Balls each buffer can hold
+	uint32_t capacity;
+
+	//Set when the writer stops or moves to a bigger segment under the same name, readers should map it again
+	std::atomic<uint32_t> retired;
+
+	double worldWidth, worldHeight;
+
+	//Steps published so far, the latest complete step is in buffer (published - 1) % 2
+	std::atomic<uint64_t> published;
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "shared counters must be lock free to work across processes");
+static_assert(sizeof(SharedBall) == 32, "SharedBall must stay packed");
+
+//Header and buffers start on their own cache lines so the writer never shares a line with the header
+inline size_t sharedAlign(size_t size){
+	return (size + 63) & ~(size_t)63;
+}
+
+inline size_t sharedBufferSize(uint32_t capacity){
+	return sharedAlign(sizeof(SharedBuffer) + (size_t)capacity*sizeof(SharedBall));
+}
+
+inline size_t sharedStateSize(uint32_t capacity){
+	return sharedAlign(sizeof(SharedStateHeader)) + 2*sharedBufferSize(capacity);
+}
+
+inline SharedBuffer* sharedBuffer(SharedStateHeader* header, int index){
+	return (SharedBuffer*)((char*)header + sharedAlign(sizeof(SharedStateHeader)) + index*sharedBufferSize(header->capacity));
+}
+
+inline SharedBall* sharedBalls(SharedBuffer* buffer){
+	return (SharedBall*)(buffer + 1);
+}
+
+#endif
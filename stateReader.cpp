@@ -0,0 +1,161 @@
+//Reference reader for the state BouncingBall publishes with --share
+//g++ -std=c++20 -O2 stateReader.cpp -lrt -o StateReader
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+#include <atomic>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "sharedState.h"
+
+//A mapped segment, read only
+struct Mapping{
+	SharedStateHeader* header;
+	size_t size;
+};
+
+//Maps the segment and checks it was written with this layout
+bool openState(const std::string& name, Mapping& mapping){
+	int fd = shm_open(name.c_str(), O_RDONLY, 0);
+	if(fd < 0){
+		return false;
+	}
+	struct stat info;
+	if(fstat(fd, &info) != 0 || info.st_size < (off_t)sizeof(SharedStateHeader)){
+		close(fd);
+		return false;
+	}
+	void* memory = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(memory == MAP_FAILED){
+		return false;
+	}
+
+	SharedStateHeader* header = (SharedStateHeader*)memory;
+	if(header->magic != SHARED_STATE_MAGIC || header->version != SHARED_STATE_VERSION || (size_t)info.st_size < sharedStateSize(header->capacity)){
+		printf("%s is not a version %u BouncingBall state segment\n", name.c_str(), SHARED_STATE_VERSION);
+		munmap(memory, info.st_size);
+		return false;
+	}
+	mapping.header = header;
+	mapping.size = info.st_size;
+	return true;
+}
+
+//Figures computed straight from the mapped balls
+struct Summary{
+	uint64_t step;
+	double time;
+	uint32_t count;
+	double energy;
+	double meanSpeed;
+	double centerX, centerY;
+};
+
+//Reads the latest complete step in place. Returns false if the writer was filling the buffer
+//meanwhile, in which case the figures may be torn and the read has to be tried again
+bool readLatest(SharedStateHeader* header, Summary& summary){
+	uint64_t published = header->published.load(std::memory_order_acquire);
+	if(published == 0){
+		return false;
+	}
+	SharedBuffer* buffer = sharedBuffer(header, (published - 1) % 2);
+	uint64_t before = buffer->sequence.load(std::memory_order_acquire);
+	if(before % 2 != 0){
+		return false;
+	}
+
+	summary.step = buffer->step;
+	summary.time = buffer->time;
+	summary.count = buffer->count < header->capacity ? buffer->count : header->capacity;
+	const SharedBall* balls = sharedBalls(buffer);
+	double energy = 0, speed = 0, x = 0, y = 0;
+	for(uint32_t i = 0; i < summary.count; i++){
+		double speedSq = balls[i].velX*balls[i].velX + balls[i].velY*balls[i].velY;
+		energy += 0.5*speedSq;
+		speed += sqrt(speedSq);
+		x += balls[i].x;
+		y += balls[i].y;
+	}
+	summary.energy = energy;
+	summary.meanSpeed = summary.count > 0 ? speed/summary.count : 0;
+	summary.centerX = summary.count > 0 ? x/summary.count : 0;
+	summary.centerY = summary.count > 0 ? y/summary.count : 0;
+
+	//Nothing read above counts unless the sequence is unchanged after it
+	std::atomic_thread_fence(std::memory_order_acquire);
+	return buffer->sequence.load(std::memory_order_relaxed) == before;
+}
+
+int main(int argc, char* args[]){
+	std::string name = SHARED_STATE_DEFAULT_NAME;
+	int intervalMs = 500;
+	int samples = 0;
+	for(int i = 1; i < argc; i++){
+		std::string arg = args[i];
+		bool hasValue = i + 1 < argc;
+		if(arg == "--interval" && hasValue){
+			intervalMs = atoi(args[++i]);
+		}
+		else if(arg == "--samples" && hasValue){
+			samples = atoi(args[++i]);
+		}
+		else if(arg[0] != '-'){
+			name = arg[0] == '/' ? arg : "/" + arg;
+		}
+		else{
+			printf("Usage: %s [name] [--interval ms] [--samples n]\n", args[0]);
+			return 1;
+		}
+	}
+
+	//Wait for the simulation to create the segment
+	Mapping mapping;
+	int waitedMs = 0;
+	while(!openState(name, mapping)){
+		if(waitedMs >= 10000){
+			printf("No state published under %s\n", name.c_str());
+			return 1;
+		}
+		usleep(100000);
+		waitedMs += 100;
+	}
+	printf("Reading %s, %u balls per buffer, world %.0f x %.0f\n", name.c_str(), mapping.header->capacity, mapping.header->worldWidth, mapping.header->worldHeight);
+
+	uint64_t retries = 0;
+	for(int sample = 0; samples == 0 || sample < samples; sample++){
+		//A retired segment was either replaced by a bigger one or the simulation ended
+		if(mapping.header->retired.load(std::memory_order_acquire)){
+			munmap(mapping.header, mapping.size);
+			if(!openState(name, mapping)){
+				printf("The simulation stopped publishing\n");
+				return 0;
+			}
+			printf("Segment grew to %u balls per buffer\n", mapping.header->capacity);
+		}
+
+		Summary summary;
+		bool read = false;
+		while(!(read = readLatest(mapping.header, summary)) && !mapping.header->retired.load(std::memory_order_acquire)){
+			retries++;
+			if(mapping.header->published.load(std::memory_order_acquire) == 0){
+				usleep(1000);
+			}
+		}
+		if(!read){
+			continue;
+		}
+		printf("step %8llu  time %8.2f s  balls %7u  energy %14.1f  mean speed %7.1f px/s  center (%.1f, %.1f)  retries %llu\n",
+			(unsigned long long)summary.step, summary.time, summary.count, summary.energy, summary.meanSpeed, summary.centerX, summary.centerY, (unsigned long long)retries);
+		fflush(stdout);
+		usleep(intervalMs*1000);
+	}
+	munmap(mapping.header, mapping.size);
+	return 0;
+}
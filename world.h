@@ -0,0 +1,109 @@
+//Embeddable interface to the simulation, built into libbouncingball by make lib
+//The engine keeps its state in globals inside its own namespace, so only one World can be started per process
+
+#ifndef WORLD_H
+#define WORLD_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <span>
+#include <vector>
+
+//Only World and the renderer interface are exported from the shared library
+#define WORLD_API __attribute__((visibility("default")))
+
+//Boundary around the balls, the same tables as --table
+enum WorldTable{
+	WORLD_TABLE_BOX,
+	WORLD_TABLE_BILLIARD,
+	WORLD_TABLE_PERIODIC
+};
+
+//Physics settings of a World, the defaults match the command line defaults
+struct WORLD_API WorldSettings{
+	//Table size in pixels
+	double width, height;
+	WorldTable table;
+
+	//Simulated seconds per step and the pull down the table in pixels per second squared, not allowed on a periodic table
+	double dt;
+	double gravity;
+
+	//Largest move per substep as a fraction of the radius, 0 disables substepping
+	double substepFraction;
+
+	//Helper threads for the parallel passes, -1 for one less than the CPU count
+	int threads;
+
+	//Spatial reorder interval in steps, 0 tunes it and -1 turns reordering off
+	int reorderInterval;
+
+	WorldSettings();
+};
+
+//Balls of one step as a renderer sees them, in the engine's array order. The spans are only valid during the draw call
+struct WorldFrame{
+	uint64_t step;
+	double time;
+	double width, height;
+	bool periodic;
+	std::span<const double> x, y;
+	std::span<const double> velX, velY;
+	std::span<const double> radius;
+};
+
+//Anything that wants to show or store the balls, handed the frame by World::render
+class WORLD_API WorldRenderer{
+	public:
+		virtual ~WorldRenderer(){}
+
+		//Draws the balls in play
+		virtual void draw(const WorldFrame& frame) = 0;
+};
+
+class WORLD_API World{
+	public:
+		World();
+		~World();
+
+		//Takes over the engine with these settings and an empty table, fails if another World is running
+		bool start(const WorldSettings& settings);
+
+		//Stops the helper threads and empties the table
+		void stop();
+
+		//Replaces every ball. All spans must have the same length and ball i keeps index i in the getters from then on
+		bool setBalls(std::span<const double> x, std::span<const double> y, std::span<const double> velX, std::span<const double> velY);
+
+		//Overwrites the velocities of the balls still in play, in setBalls order
+		bool setVelocities(std::span<const double> velX, std::span<const double> velY);
+
+		//Copies the balls out in setBalls order, balls that dropped into a pocket read as NaN. The spans must hold getCount() values
+		bool getPositions(std::span<double> x, std::span<double> y);
+		bool getVelocities(std::span<double> velX, std::span<double> velY);
+
+		//Balls given to setBalls, and how many of them are still in play
+		size_t getCount();
+		size_t getInPlay();
+
+		//Advances n steps without returning in between
+		void step(int n);
+
+		//Steps taken since setBalls and the simulated time they cover
+		uint64_t getSteps();
+		double getTime();
+
+		//Hands the current balls to a renderer
+		void render(WorldRenderer& renderer);
+
+	private:
+		//Registry handle of each ball in setBalls order, slot in the low and generation in the high 32 bits
+		std::vector<uint64_t> mHandles;
+
+		//Gathered columns for render
+		std::vector<double> mX, mY, mVelX, mVelY, mRadius;
+
+		bool mStarted;
+};
+
+#endif